@@ -0,0 +1,37 @@
+/* Syntax highlighting database, shared by lite.c and by hlgen.c, which
+generates a specialized highlighter for every entry at build time. */
+
+#define HL_HIGHLIGHT_NUMBERS (1<<0)
+#define HL_HIGHLIGHT_STRINGS (1<<1)
+
+struct editorSyntax {
+    char *filetype;
+    char **filematch;
+    int flags;
+    char *singleline_comment_start; // single comment line pattern for this language
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    char **keywords;
+};
+
+char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
+
+// keywords with '|' at the end are type 2 keywords
+char *C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "define", "include", "NULL|", NULL
+};
+
+struct editorSyntax HLDB[] = {
+    {
+        "c",
+        C_HL_extensions,
+        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        "//", "/*", "*/",
+        C_HL_keywords
+    },
+};
+
+#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
@@ -0,0 +1,207 @@
+/* Generates a specialized highlighter for every HLDB entry of hldb.h.
+
+Each generated function is the generic editorUpdateSyntax loop with the
+entry's flags, comment delimiters and keywords baked in as constants: the
+disabled branches are left out, delimiters are compared char by char and
+keywords are matched through a switch on their first char. The output is
+included by lite.c, see the Makefile. */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "hldb.h"
+
+// writes s as the body of a C string or char literal
+void emitEscaped(const char *s, int len) {
+    for (int i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '\\' || c == '"' || c == '\'') {
+            printf("\\%c", c);
+        } else if (isprint(c)) {
+            putchar(c);
+        } else {
+            printf("\\%03o", c);
+        }
+    }
+}
+
+// writes a condition true when delimiter d starts at render offset i
+void emitMatch(const char *d) {
+    int len = strlen(d);
+    printf("i + %d <= n", len);
+    for (int k = 0; k < len; k++) {
+        printf(" && r[i + %d] == '", k);
+        emitEscaped(&d[k], 1);
+        printf("'");
+    }
+}
+
+void emitFunctionName(struct editorSyntax *s) {
+    printf("editorHighlight");
+    for (int i = 0; s->filetype[i]; i++) {
+        char c = s->filetype[i];
+        putchar(isalnum((unsigned char)c) ? (i == 0 ? toupper((unsigned char)c) : c) : '_');
+    }
+}
+
+void emitKeywords(char **keywords) {
+    char done[256] = {0};
+
+    printf("        if (prev_sep) {\n");
+    printf("            int klen = 0, kind = HL_NORMAL;\n");
+    printf("            switch (c) {\n");
+    for (int j = 0; keywords[j]; j++) {
+        unsigned char first = keywords[j][0];
+        if (done[first]) continue;
+        done[first] = 1;
+
+        printf("                case '");
+        emitEscaped(keywords[j], 1);
+        printf("':\n");
+        // keep HLDB order within a first char, the generic loop takes the first match
+        for (int k = j; keywords[k]; k++) {
+            if ((unsigned char)keywords[k][0] != first) continue;
+            int klen = strlen(keywords[k]);
+            int kw2 = keywords[k][klen - 1] == '|';
+            if (kw2) klen--;
+            printf("                    if (i + %d <= n && !memcmp(&r[i], \"", klen);
+            emitEscaped(keywords[k], klen);
+            printf("\", %d) && is_separator(r[i + %d])) {\n", klen, klen);
+            printf("                        klen = %d;\n", klen);
+            printf("                        kind = %s;\n", kw2 ? "HL_KEYWORD2" : "HL_KEYWORD1");
+            printf("                        break;\n");
+            printf("                    }\n");
+        }
+        printf("                    break;\n");
+    }
+    printf("            }\n");
+    printf("            if (klen) {\n");
+    printf("                memset(&hl[i], kind, klen);\n");
+    printf("                i += klen;\n");
+    printf("                prev_sep = 0;\n");
+    printf("                continue;\n");
+    printf("            }\n");
+    printf("        }\n\n");
+}
+
+void emitHighlighter(struct editorSyntax *s) {
+    char *scs = s->singleline_comment_start;
+    char *mcs = s->multiline_comment_start;
+    char *mce = s->multiline_comment_end;
+    int multiline = mcs && mce && *mcs && *mce;
+
+    printf("// highlighter for filetype \"%s\"\n", s->filetype);
+    printf("int ");
+    emitFunctionName(s);
+    printf("(editorrow *row) {\n");
+    printf("    char *r = row->render;\n");
+    printf("    unsigned char *hl = row->hl;\n");
+    printf("    int n = row->rsize;\n\n");
+    printf("    ST.syntaxRows++;\n");
+    printf("    memset(hl, HL_NORMAL, n);\n\n");
+    printf("    int prev_sep = 1;\n");
+    printf("    int in_string = 0;\n");
+    printf("    int in_comment = (row->idx > 0 && E.erow[row->idx - 1].hl_open_comment == 1);\n\n");
+    printf("    int i = 0;\n");
+    printf("    while (i < n) {\n");
+    printf("        char c = r[i];\n");
+    if (s->flags & HL_HIGHLIGHT_NUMBERS) {
+        printf("        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;\n");
+    }
+    printf("\n");
+
+    if (scs && *scs) {
+        printf("        if (!in_string && !in_comment && ");
+        emitMatch(scs);
+        printf(") {\n");
+        printf("            memset(&hl[i], HL_COMMENT, n - i);\n");
+        printf("            break;\n");
+        printf("        }\n\n");
+    }
+
+    if (multiline) {
+        printf("        if (!in_string) {\n");
+        printf("            if (in_comment) {\n");
+        printf("                hl[i] = HL_MLCOMMENT;\n");
+        printf("                if (");
+        emitMatch(mce);
+        printf(") {\n");
+        printf("                    memset(&hl[i], HL_MLCOMMENT, %d);\n", (int)strlen(mce));
+        printf("                    i += %d;\n", (int)strlen(mce));
+        printf("                    in_comment = 0;\n");
+        printf("                    prev_sep = 1;\n");
+        printf("                    continue;\n");
+        printf("                }\n");
+        printf("                i++;\n");
+        printf("                continue;\n");
+        printf("            } else if (");
+        emitMatch(mcs);
+        printf(") {\n");
+        printf("                memset(&hl[i], HL_MLCOMMENT, %d);\n", (int)strlen(mcs));
+        printf("                i += %d;\n", (int)strlen(mcs));
+        printf("                in_comment = 1;\n");
+        printf("                continue;\n");
+        printf("            }\n");
+        printf("        }\n\n");
+    }
+
+    if (s->flags & HL_HIGHLIGHT_STRINGS) {
+        printf("        if (in_string) {\n");
+        printf("            hl[i] = HL_STRING;\n");
+        printf("            if (c == '\\\\' && i + 1 < n) {\n");
+        printf("                hl[i + 1] = HL_STRING;\n");
+        printf("                i += 2;\n");
+        printf("                continue;\n");
+        printf("            }\n");
+        printf("            if (c == in_string) in_string = 0;\n");
+        printf("            i++;\n");
+        printf("            prev_sep = 1;\n");
+        printf("            continue;\n");
+        printf("        } else if (c == '\"' || c == '\\'') {\n");
+        printf("            in_string = c;\n");
+        printf("            hl[i] = HL_STRING;\n");
+        printf("            i++;\n");
+        printf("            continue;\n");
+        printf("        }\n\n");
+    }
+
+    if (s->flags & HL_HIGHLIGHT_NUMBERS) {
+        printf("        if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||\n");
+        printf("            (c == '.' && prev_hl == HL_NUMBER)) {\n");
+        printf("            hl[i] = HL_NUMBER;\n");
+        printf("            i++;\n");
+        printf("            prev_sep = 0;\n");
+        printf("            continue;\n");
+        printf("        }\n\n");
+    }
+
+    if (s->keywords && s->keywords[0]) {
+        emitKeywords(s->keywords);
+    }
+
+    printf("        prev_sep = is_separator(c);\n");
+    printf("        i++;\n");
+    printf("    }\n\n");
+    printf("    int changed = (row->hl_open_comment != in_comment);\n");
+    printf("    row->hl_open_comment = in_comment;\n");
+    printf("    return changed;\n");
+    printf("}\n\n");
+}
+
+int main() {
+    printf("/* Generated by hlgen from hldb.h, do not edit. */\n\n");
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        emitHighlighter(&HLDB[j]);
+    }
+
+    printf("// indexed like HLDB\n");
+    printf("int (*editorGeneratedHighlighters[])(editorrow *row) = {\n");
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        printf("    ");
+        emitFunctionName(&HLDB[j]);
+        printf(",\n");
+    }
+    printf("};\n");
+    return 0;
+}
@@ -16,6 +16,16 @@
 #include <time.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <malloc.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <signal.h>
 
 /*** defines ***/
 
@@ -23,8 +33,21 @@
 #define EDITOR_VERSION "0.0.1"
 #define EDITOR_TAB 8
 #define EDITOR_QUIT_TIMES 1
-#define HL_HIGHLIGHT_NUMBERS (1<<0)
-#define HL_HIGHLIGHT_STRINGS (1<<1)
+#define POOL_MIN_SHIFT 4 // smallest row text class holds 16 bytes
+#define POOL_CLASSES 9 // largest class holds 4096 bytes
+#define POOL_MAX_BLOCK (1 << (POOL_MIN_SHIFT + POOL_CLASSES - 1))
+#define POOL_SLAB_SIZE (64 * 1024)
+#define FRAME_RATE 60 // redraws per second while keys are queued
+#define FRAME_MAX_INTERVAL 0.1 // slowest pacing for a terminal that falls behind
+#define SYMBOLS_SLICE_MS 5 // symbol indexing done between two input checks
+#define WORDS_SLICE_MS 5 // word indexing of lazy rows done between two input checks
+#define PREFETCH_SLICE_MS 2 // rows made ready ahead of the view between two input checks
+#define PREFETCH_PAGES 2 // screens made ready in the scroll direction, one against it
+#define WORDS_MIN_LEN 3 // shorter identifiers are not worth completing
+#define COMPLETE_MAX 16 // completions offered for a prefix
+#define HEX_ROW_BYTES 16 // bytes per row of the hex view
+#define SAVE_CHUNK (1 << 20) // changed rows are written in chunks of this size
+#define SAVE_MIN_COPY 65536 // shorter unchanged runs are written from the rows
 
 enum editorKey {
     BACKSPACE = 127,
@@ -50,28 +73,67 @@ enum editorHighlight {
     HL_MLCOMMENT
 };
 
-/*** data ***/
-
-struct editorSyntax {
-    char *filetype;
-    char **filematch;
-    int flags;
-    char *singleline_comment_start; // single comment line pattern for this language
-    char *multiline_comment_start;
-    char *multiline_comment_end;
-    char **keywords;
+enum editorSelection {
+    SELECT_NONE = 0,
+    SELECT_BLOCK,
+    SELECT_CHAR,
+    SELECT_LINE
 };
 
+/*** data ***/
+
 typedef struct editorrow {
     int idx;
     int length;
+    int capacity; // bytes allocated for text, from E.pool
     char *text;
     int rsize;
+    int rcapacity; // bytes allocated for render and for hl
     char *render;
     unsigned char *hl; // stores the syntax highlighting codes for each render char
     int hl_open_comment;
+    int *wrap; // render offsets where the 2nd, 3rd... visual lines start in soft wrap mode
+    int nwrap;
+    int symbols; // definitions indexed from this row, -1 while stale
+    int lazy; // render and hl not built yet, hl_open_comment is -1 unless known
+    int shared; // text may be held by other rows too, copied before it is written
+    long long origin; // offset of the row in the file it was loaded from, -1 once its text changed
+    int words; // the identifiers of text are counted in the word index
 } editorrow;
 
+struct fenwickTree {
+    long long *tree; // 1 indexed
+    int size;
+    int capacity;
+};
+
+struct indexBlock {
+    long long *values; // room for 2 * INDEX_BLOCK
+    int count;
+    long long sum;
+};
+
+struct rowIndex {
+    struct indexBlock *blocks;
+    int nblocks;
+    int capacity;
+    struct fenwickTree counts; // rows in each block
+    struct fenwickTree sums; // sum of the values in each block
+    int size; // values covered
+    int stale;
+};
+
+struct textPool {
+    char *freelist[POOL_CLASSES];
+    char *slabs;
+    char *cursor; // free space in the newest slab
+    char *end;
+    char **shared; // blocks held by more than one row, open addressing
+    int *refs; // holders of each shared block
+    int nshared;
+    int shareSize; // slots in shared, a power of two
+};
+
 struct editorConfig {
     struct termios originalTermi;
     int screenrows; // 1 indexed
@@ -80,43 +142,336 @@ struct editorConfig {
     int cursorY; // 0 indexed
     editorrow* erow;
     int numrows; // 1 indexed
+    int rowcap; // rows allocated in erow
+    struct textPool pool; // row text storage
     int rowOff; // 0 indexed
     int colOff; // 0 indexed
     int renderX; // 0 indexed
     char* filename;
+    struct stat origin; // the file row origins refer to, st_ino is 0 when none
     char statusmsg[80];
     time_t statusmsg_time;
     int dirty;
     struct editorSyntax *syntax;
+    int (*highlight)(editorrow *row); // highlighter generated for syntax
+    struct rowIndex lines; // file length of each row, '\n' included
+    int watchfd; // inotify instance, -1 if unavailable
+    int watchwd; // watch on the directory of filename
+    int diskChanged; // 1 when the file changed on disk, 2 once a conflict was reported
+    int inPrompt;
+    int softWrap;
+    int wrapOff; // first visible visual line of row rowOff in soft wrap mode
+    int scrollDir; // 1 when the view last moved down, -1 up
+    int prefetchTop; // rowOff when the scroll direction was last taken
+    struct rowIndex vlines; // visual lines of each row, kept while softWrap is on
+    int screenCursorY; // cursor position on screen, 0 indexed
+    int screenCursorX;
+    int streamfd; // pipe rows are being read from, -1 if none
+    int followfd; // file followed for appended rows, -1 if none
+    char *streamName;
+    int followPending; // the followed file has data not read yet
+    char *streamLine; // a line that has not seen its '\n' yet
+    int streamLineLen;
+    int streamLineCap;
+    long long streamBytes;
+    double streamTime; // seconds spent ingesting streamBytes
+    int statsPanel; // memory report shown instead of the rows
+    double frameTime; // when the last frame was drawn
+    double frameInterval; // minimum time between frames while input is queued
+    double frameCost; // moving average of the time spent drawing a frame
+    int framePending; // a frame was skipped and the screen is stale
+    int selection; // SELECT_NONE, SELECT_BLOCK, SELECT_CHAR or SELECT_LINE
+    int selAnchorY; // the corner of the selection the cursor does not move
+    int selAnchorX; // render column in block selection, text offset otherwise
+    int selCursorX; // render column of the cursor side of the block
+    int batch; // replaying keys: highlighting is deferred and nothing is drawn
+    int batchLo, batchHi; // rows whose highlighting was deferred, none while lo > hi
+    unsigned long long *screenLines; // hash of each line on screen, NULL until the first frame
+    long long screenTop; // top visual line of the text on screen
 } E;
 
 /*** filetypes ***/
-char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
-
-// keywords with '|' at the end are type 2 keywords
-char *C_HL_keywords[] = {
-    "switch", "if", "while", "for", "break", "continue", "return", "else",
-    "struct", "union", "typedef", "static", "enum", "class", "case",
-    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
-    "void|", "define", "include", "NULL|", NULL
-};
-
-struct editorSyntax HLDB[] = {
-    {
-        "c",
-        C_HL_extensions,
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
-        "//", "/*", "*/",
-        C_HL_keywords
-    },
-};
 
-#define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
+#include "hldb.h"
 
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *formatstr, ...);
 char* editorPrompt(char *prompt, void (*callback)(char* query, int cur_key));
+void editorRefreshTerminal();
+void editorFrameDrawn(double start);
+int editorWatchService();
+int editorWatchPending();
+void editorWatchFile();
+int editorWatchDrain();
+void editorRowWrap(editorrow *row);
+void editorRowMaterialize(editorrow *row);
+void editorRenderRow(editorrow *row);
+void editorFollowService();
+int editorFollowPending();
+void editorStreamService();
+void editorSymbolsStale(editorrow *row);
+void editorSymbolsInserted(int at, int count);
+void editorSymbolsRemoved(int at, int count);
+void editorSymbolsClear();
+void editorSymbolsAllStale();
+int editorSymbolsPending();
+int editorSymbolsIndex(double budget);
+int editorWordsPending();
+int editorWordsIndex(double budget);
+int editorPrefetchPending();
+int editorPrefetch(double budget);
+int editorInputPending();
+void editorOutline();
+void editorSelectionSpan(editorrow *row, int *s0, int *s1);
+int editorSelectionBounds(int *y0, int *x0, int *y1, int *x1);
+void editorClipboardClear();
+void editorHexClose();
+void editorBatchRowsMoved(int at, int delta);
+void editorBatchDefer(int lo, int hi);
+void editorMacroToggle();
+void editorMacroPlay();
+void editorFilter();
+unsigned long long editorHashLine(const char *s, int len);
+int editorOpenCached();
+int editorCacheDir(char *dir, size_t size);
+void editorCacheSave(struct stat *st, int *filelen);
+void editorScreenReset();
+
+/*** memory accounting ***/
+
+/* Heap use is accounted per subsystem through the mem* wrappers below,
+using the usable size glibc reports for each block, so the numbers match
+what the allocator really holds. ST also collects load time profiling,
+which is only switched on by --stats. */
+
+enum memSubsystem {
+    MEM_ROW_TEXT = 0,
+    MEM_ROW_RENDER,
+    MEM_ROW_HL,
+    MEM_ROW_ARRAY,
+    MEM_WRAP,
+    MEM_INDEX,
+    MEM_APPEND_BUFFER,
+    MEM_SEARCH,
+    MEM_SYMBOLS,
+    MEM_WORDS,
+    MEM_CLIPBOARD,
+    MEM_HEX,
+    MEM_FILTER,
+    MEM_MACRO,
+    MEM_SUBSYSTEMS
+};
+
+char *memSubsystemNames[MEM_SUBSYSTEMS] = {
+    "row text", "row render", "row hl", "row array",
+    "wrap layout", "line index", "append buffer", "search",
+    "symbols", "word index", "clipboard", "hex overlay",
+    "filter output", "macro"
+};
+
+struct memStat {
+    long long bytes;
+    long long peak;
+    long long allocs; // malloc and realloc calls
+};
+
+struct editorStats {
+    struct memStat mem[MEM_SUBSYSTEMS];
+    long long bytes; // all subsystems
+    long long peak;
+    int timing; // profile editorUpdateRow and editorUpdateSyntax
+    long long updateRowCalls;
+    double updateRowTime;
+    long long syntaxCalls;
+    long long syntaxRows; // including rows re-highlighted by comment propagation
+    long long lazyRendered; // lazy rows given their render and hl
+    long long prefetchRows; // of those, the ones rendered while idle
+    double prefetchTime;
+    double syntaxTime;
+    long long framesDrawn;
+    long long framesSkipped;
+    long long outputBytes; // written to the terminal by frames
+    int frameBytes; // of the last frame
+    double fps; // frames drawn over the last second
+    double peakFps;
+    double fpsStart; // start of the second being counted
+    int fpsFrames;
+} ST;
+
+double editorNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void memAccount(int sys, long long delta, int alloc) {
+    struct memStat *m = &ST.mem[sys];
+    m->bytes += delta;
+    m->allocs += alloc;
+    if (m->bytes > m->peak) m->peak = m->bytes;
+    ST.bytes += delta;
+    if (ST.bytes > ST.peak) ST.peak = ST.bytes;
+}
+
+void *memRealloc(int sys, void *ptr, size_t size) {
+    long long old = ptr ? (long long)malloc_usable_size(ptr) : 0;
+    void *new = realloc(ptr, size);
+    if (new == NULL && size) return NULL;
+    memAccount(sys, (new ? (long long)malloc_usable_size(new) : 0) - old, 1);
+    return new;
+}
+
+void *memAlloc(int sys, size_t size) {
+    return memRealloc(sys, NULL, size);
+}
+
+void *memCalloc(int sys, size_t n, size_t size) {
+    void *p = calloc(n, size);
+    if (p) memAccount(sys, malloc_usable_size(p), 1);
+    return p;
+}
+
+void memFree(int sys, void *ptr) {
+    if (ptr == NULL) return;
+    memAccount(sys, -(long long)malloc_usable_size(ptr), 0);
+    free(ptr);
+}
+
+/*** row text pool ***/
+
+/* Row text lives in power of two size classes carved out of slabs owned by
+the editor. Freed blocks go on a free list per class and are reused by the
+next row that needs that class, so typing into a row reaches the system
+allocator only when its capacity doubles past the largest class. Closing
+the buffer releases every slab at once. */
+
+int poolClass(size_t size) {
+    int c = 0;
+    while (((size_t)1 << (POOL_MIN_SHIFT + c)) < size) c++;
+    return c;
+}
+
+// returns a block of at least size bytes, its usable size is stored in *capacity
+char *poolAlloc(struct textPool *pool, size_t size, int *capacity) {
+    if (size > POOL_MAX_BLOCK) {
+        *capacity = size;
+        return memAlloc(MEM_ROW_TEXT, size);
+    }
+
+    int c = poolClass(size);
+    int block = 1 << (POOL_MIN_SHIFT + c);
+    *capacity = block;
+    if (pool->freelist[c]) {
+        char *p = pool->freelist[c];
+        memcpy(&pool->freelist[c], p, sizeof(char *));
+        return p;
+    }
+    if (pool->cursor == NULL || pool->end - pool->cursor < block) {
+        char *slab = memAlloc(MEM_ROW_TEXT, POOL_SLAB_SIZE);
+        memcpy(slab, &pool->slabs, sizeof(char *)); // slabs are chained by their first word
+        pool->slabs = slab;
+        pool->cursor = slab + sizeof(char *);
+        pool->end = slab + POOL_SLAB_SIZE;
+    }
+    char *p = pool->cursor;
+    pool->cursor += block;
+    return p;
+}
+
+void poolFree(struct textPool *pool, char *p, int capacity) {
+    if (p == NULL) return;
+    if (capacity > POOL_MAX_BLOCK) {
+        memFree(MEM_ROW_TEXT, p);
+        return;
+    }
+    int c = poolClass(capacity);
+    memcpy(p, &pool->freelist[c], sizeof(char *));
+    pool->freelist[c] = p;
+}
+
+// frees every slab; blocks larger than the classes must have been freed already
+void poolRelease(struct textPool *pool) {
+    while (pool->slabs) {
+        char *next;
+        memcpy(&next, pool->slabs, sizeof(char *));
+        memFree(MEM_ROW_TEXT, pool->slabs);
+        pool->slabs = next;
+    }
+    memFree(MEM_ROW_TEXT, pool->shared);
+    memFree(MEM_ROW_TEXT, pool->refs);
+    memset(pool, 0, sizeof(struct textPool));
+}
+
+/* A block can be held by several rows after a copy, its holders are then
+counted in a table keyed by the block address. Blocks held by one row, the
+common case, are not in the table at all. */
+
+unsigned int poolShareHash(char *p) {
+    return (unsigned int)(((unsigned long long)(size_t)p >> 4) * 0x9E3779B97F4A7C15ULL >> 32);
+}
+
+// slot holding p, or the empty slot where it would go
+int poolShareSlot(struct textPool *pool, char *p) {
+    int mask = pool->shareSize - 1;
+    int i = poolShareHash(p) & mask;
+    while (pool->shared[i] && pool->shared[i] != p) i = (i + 1) & mask;
+    return i;
+}
+
+void poolShareRehash(struct textPool *pool, int size) {
+    char **shared = pool->shared;
+    int *refs = pool->refs, old = pool->shareSize;
+    pool->shared = memCalloc(MEM_ROW_TEXT, size, sizeof(char *));
+    pool->refs = memAlloc(MEM_ROW_TEXT, sizeof(int) * size);
+    pool->shareSize = size;
+    for (int i = 0; i < old; i++) {
+        if (shared[i] == NULL) continue;
+        int j = poolShareSlot(pool, shared[i]);
+        pool->shared[j] = shared[i];
+        pool->refs[j] = refs[i];
+    }
+    memFree(MEM_ROW_TEXT, shared);
+    memFree(MEM_ROW_TEXT, refs);
+}
+
+// adds a holder to block p
+void poolShare(struct textPool *pool, char *p) {
+    if ((pool->nshared + 1) * 2 > pool->shareSize) {
+        poolShareRehash(pool, pool->shareSize ? pool->shareSize * 2 : 64);
+    }
+    int i = poolShareSlot(pool, p);
+    if (pool->shared[i]) {
+        pool->refs[i]++;
+        return;
+    }
+    pool->shared[i] = p;
+    pool->refs[i] = 2;
+    pool->nshared++;
+}
+
+/* Drops a holder of block p, returns 1 when it was the only one left and
+may free or write p. */
+int poolUnshare(struct textPool *pool, char *p) {
+    if (pool->nshared == 0) return 1;
+    int i = poolShareSlot(pool, p);
+    if (pool->shared[i] == NULL) return 1;
+    if (--pool->refs[i] > 1) return 0;
+
+    // the last holder owns p again; remove the entry, moving back the probes after it
+    int mask = pool->shareSize - 1, j = i;
+    pool->shared[i] = NULL;
+    pool->nshared--;
+    while (pool->shared[j = (j + 1) & mask]) {
+        int k = poolShareHash(pool->shared[j]) & mask;
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j)) continue;
+        pool->shared[i] = pool->shared[j];
+        pool->refs[i] = pool->refs[j];
+        pool->shared[j] = NULL;
+        i = j;
+    }
+    return 0;
+}
 
 /*** struct append buffer ***/
 
@@ -128,7 +483,7 @@ struct AppendBuffer {
 };
 
 void abAppend(struct AppendBuffer* ab, char* s, int len) {
-    char* new = realloc(ab->buffer, ab->length + len);
+    char* new = memRealloc(MEM_APPEND_BUFFER, ab->buffer, ab->length + len);
 
     if (new == NULL) {
         return ;
@@ -139,7 +494,247 @@ void abAppend(struct AppendBuffer* ab, char* s, int len) {
 }
 
 void abFree(struct AppendBuffer *ab) {
-    free(ab->buffer);
+    memFree(MEM_APPEND_BUFFER, ab->buffer);
+}
+
+/*** prefix sums ***/
+
+/* Fenwick tree over per-block values. Point updates, prefix sums and
+searches are O(log n). */
+
+void fenwickAdd(struct fenwickTree *f, int i, long long delta) {
+    for (i++; i <= f->size; i += i & (-i)) {
+        f->tree[i] += delta;
+    }
+}
+
+// sum of the values at [0, i)
+long long fenwickPrefix(struct fenwickTree *f, int i) {
+    long long sum = 0;
+    if (i > f->size) i = f->size;
+    for (; i > 0; i -= i & (-i)) {
+        sum += f->tree[i];
+    }
+    return sum;
+}
+
+static void fenwickReserve(struct fenwickTree *f, int size) {
+    if (size + 1 <= f->capacity) return;
+    f->capacity = f->capacity ? f->capacity * 2 : 64;
+    if (f->capacity < size + 1) f->capacity = size + 1;
+    f->tree = memRealloc(MEM_INDEX, f->tree, sizeof(long long) * f->capacity);
+}
+
+// builds the tree from the values already stored at tree[1..size]
+static void fenwickLink(struct fenwickTree *f) {
+    for (int i = 1; i <= f->size; i++) {
+        int parent = i + (i & (-i));
+        if (parent <= f->size) f->tree[parent] += f->tree[i];
+    }
+}
+
+// largest i such that the sum of [0, i) is <= target
+int fenwickSearch(struct fenwickTree *f, long long target) {
+    int pos = 0;
+    int step = 1;
+    while (step * 2 <= f->size) step *= 2;
+    for (; step > 0; step /= 2) {
+        if (pos + step <= f->size && f->tree[pos + step] <= target) {
+            pos += step;
+            target -= f->tree[pos];
+        }
+    }
+    return pos;
+}
+
+void fenwickFree(struct fenwickTree *f) {
+    memFree(MEM_INDEX, f->tree);
+    f->tree = NULL;
+    f->size = f->capacity = 0;
+}
+
+/* Per-row values, such as the file length of each row, kept in blocks of
+consecutive rows with Fenwick trees over the row count and the value sum of
+each block. A row is found by searching the counts, so inserting or deleting
+rows anywhere only shifts the values of one block and updates two trees in
+O(log n). A block that fills up is split and one that empties is dropped,
+which rebuilds the trees over the blocks in O(n / INDEX_BLOCK). A prefix sum
+adds the values before the row in its block, up to 2 * INDEX_BLOCK of them. */
+
+#define INDEX_BLOCK 256 // rows a block is built with, it holds up to twice that
+
+static struct indexBlock *rowIndexAddBlock(struct rowIndex *x, int b) {
+    if (x->nblocks == x->capacity) {
+        x->capacity = x->capacity ? x->capacity * 2 : 16;
+        x->blocks = memRealloc(MEM_INDEX, x->blocks, sizeof(struct indexBlock) * x->capacity);
+    }
+    memmove(&x->blocks[b + 1], &x->blocks[b], sizeof(struct indexBlock) * (x->nblocks - b));
+    x->nblocks++;
+    x->blocks[b].values = memAlloc(MEM_INDEX, sizeof(long long) * INDEX_BLOCK * 2);
+    x->blocks[b].count = 0;
+    x->blocks[b].sum = 0;
+    return &x->blocks[b];
+}
+
+static void rowIndexDropBlock(struct rowIndex *x, int b) {
+    memFree(MEM_INDEX, x->blocks[b].values);
+    memmove(&x->blocks[b], &x->blocks[b + 1], sizeof(struct indexBlock) * (x->nblocks - b - 1));
+    x->nblocks--;
+}
+
+// rebuilds both trees from the counts and sums of the blocks
+static void rowIndexLink(struct rowIndex *x) {
+    fenwickReserve(&x->counts, x->nblocks);
+    fenwickReserve(&x->sums, x->nblocks);
+    x->counts.size = x->sums.size = x->nblocks;
+    for (int b = 0; b < x->nblocks; b++) {
+        x->counts.tree[b + 1] = x->blocks[b].count;
+        x->sums.tree[b + 1] = x->blocks[b].sum;
+    }
+    fenwickLink(&x->counts);
+    fenwickLink(&x->sums);
+}
+
+// block holding row i, or the last block when i is the size, *off set to i's place in it
+static int rowIndexLocate(struct rowIndex *x, int i, int *off) {
+    if (x->nblocks == 0) {
+        rowIndexAddBlock(x, 0);
+        rowIndexLink(x);
+    }
+    int b = fenwickSearch(&x->counts, i);
+    if (b == x->nblocks) b--;
+    *off = i - fenwickPrefix(&x->counts, b);
+    return b;
+}
+
+void rowIndexFree(struct rowIndex *x) {
+    for (int b = 0; b < x->nblocks; b++) {
+        memFree(MEM_INDEX, x->blocks[b].values);
+    }
+    memFree(MEM_INDEX, x->blocks);
+    x->blocks = NULL;
+    x->nblocks = x->capacity = 0;
+    fenwickFree(&x->counts);
+    fenwickFree(&x->sums);
+    x->size = 0;
+    x->stale = 0;
+}
+
+void rowIndexBuild(struct rowIndex *x, int size, long long (*value)(int)) {
+    rowIndexFree(x);
+    for (int i = 0; i < size; i += INDEX_BLOCK) {
+        struct indexBlock *blk = rowIndexAddBlock(x, x->nblocks);
+        for (int j = i; j < size && j < i + INDEX_BLOCK; j++) {
+            blk->sum += blk->values[blk->count++] = value(j);
+        }
+    }
+    x->size = size;
+    rowIndexLink(x);
+}
+
+// sum of the values at [0, i)
+long long rowIndexPrefix(struct rowIndex *x, int i) {
+    if (i >= x->size) return fenwickPrefix(&x->sums, x->nblocks);
+    int off, b = rowIndexLocate(x, i, &off);
+    long long sum = fenwickPrefix(&x->sums, b);
+    for (int j = 0; j < off; j++) sum += x->blocks[b].values[j];
+    return sum;
+}
+
+// largest i such that the sum of [0, i) is <= target
+int rowIndexSearch(struct rowIndex *x, long long target) {
+    int b = fenwickSearch(&x->sums, target);
+    if (b == x->nblocks) return x->size;
+    target -= fenwickPrefix(&x->sums, b);
+    struct indexBlock *blk = &x->blocks[b];
+    int off = 0;
+    while (off < blk->count && blk->values[off] <= target) target -= blk->values[off++];
+    return fenwickPrefix(&x->counts, b) + off;
+}
+
+// sets the value at i, ignored while the index is stale or does not cover i
+void rowIndexSet(struct rowIndex *x, int i, long long value) {
+    if (x->stale || i >= x->size) return;
+    int off, b = rowIndexLocate(x, i, &off);
+    struct indexBlock *blk = &x->blocks[b];
+    long long delta = value - blk->values[off];
+    if (delta == 0) return;
+    blk->values[off] = value;
+    blk->sum += delta;
+    fenwickAdd(&x->sums, b, delta);
+}
+
+// count values were inserted at at, value(i) gives the new ones
+void rowIndexInserted(struct rowIndex *x, int at, int count, long long (*value)(int)) {
+    if (x->stale || at > x->size) {
+        x->stale = 1;
+        return;
+    }
+    int off, b = rowIndexLocate(x, at, &off);
+    struct indexBlock *blk = &x->blocks[b];
+    x->size += count;
+
+    if (blk->count + count <= INDEX_BLOCK * 2) { // fits: shift the rest of the block
+        memmove(&blk->values[off + count], &blk->values[off], sizeof(long long) * (blk->count - off));
+        long long sum = 0;
+        for (int j = 0; j < count; j++) sum += blk->values[off + j] = value(at + j);
+        blk->count += count;
+        blk->sum += sum;
+        fenwickAdd(&x->counts, b, count);
+        fenwickAdd(&x->sums, b, sum);
+        return;
+    }
+
+    // the rows after at move to a block of their own, the new rows fill the blocks before it
+    if (off < blk->count) {
+        struct indexBlock *tail = rowIndexAddBlock(x, b + 1);
+        blk = &x->blocks[b];
+        tail->count = blk->count - off;
+        memcpy(tail->values, &blk->values[off], sizeof(long long) * tail->count);
+        for (int j = 0; j < tail->count; j++) tail->sum += tail->values[j];
+        blk->count = off;
+        blk->sum -= tail->sum;
+    }
+    for (int i = at; i < at + count; i++) {
+        if (blk->count >= INDEX_BLOCK) blk = rowIndexAddBlock(x, ++b);
+        blk->sum += blk->values[blk->count++] = value(i);
+    }
+    rowIndexLink(x);
+}
+
+// count values were removed at at, out of the size values covered before
+void rowIndexRemoved(struct rowIndex *x, int at, int count, int size) {
+    if (x->stale || x->size != size) {
+        x->stale = 1;
+        return;
+    }
+    int off, b = rowIndexLocate(x, at, &off);
+    struct indexBlock *blk = &x->blocks[b];
+    x->size -= count;
+
+    if (off + count < blk->count) { // within one block that keeps rows
+        long long sum = 0;
+        for (int j = off; j < off + count; j++) sum += blk->values[j];
+        memmove(&blk->values[off], &blk->values[off + count], sizeof(long long) * (blk->count - off - count));
+        blk->count -= count;
+        blk->sum -= sum;
+        fenwickAdd(&x->counts, b, -count);
+        fenwickAdd(&x->sums, b, -sum);
+        return;
+    }
+
+    while (count > 0) {
+        blk = &x->blocks[b];
+        int n = blk->count - off < count ? blk->count - off : count;
+        for (int j = off; j < off + n; j++) blk->sum -= blk->values[j];
+        memmove(&blk->values[off], &blk->values[off + n], sizeof(long long) * (blk->count - off - n));
+        blk->count -= n;
+        count -= n;
+        if (blk->count == 0) rowIndexDropBlock(x, b);
+        else b++;
+        off = 0;
+    }
+    rowIndexLink(x);
 }
 
 /*** terminal ***/
@@ -174,10 +769,70 @@ void enableRawMode() {
     die("tcsetattr");
 }
 
-int editorReadKey() {
+// blocks until a key is pending, servicing the file watch meanwhile
+void editorWaitForKey() {
+    while (1) {
+        if (editorWatchPending() && editorWatchService()) { // seen during a prompt
+            editorRefreshTerminal();
+        }
+
+        struct pollfd fds[3];
+        int nfds = 0, watch = -1, stream = -1;
+        fds[nfds].fd = STDIN_FILENO;
+        fds[nfds++].events = POLLIN;
+        if (E.watchfd != -1) {
+            watch = nfds;
+            fds[nfds].fd = E.watchfd;
+            fds[nfds++].events = POLLIN;
+        }
+        if (E.streamfd != -1 && !E.inPrompt) {
+            stream = nfds;
+            fds[nfds].fd = E.streamfd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        // while nothing is queued a skipped frame is drawn, then the followed
+        // file read, the rows around the view made ready, then the symbols
+        // and words indexed
+        int idle = E.framePending || editorFollowPending() || editorPrefetchPending() ||
+            editorSymbolsPending() || editorWordsPending();
+        int ready = poll(fds, nfds, idle ? 0 : -1);
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            die("poll");
+        }
+        if (ready == 0) {
+            if (E.framePending) {
+                editorRefreshTerminal();
+            } else if (editorFollowPending()) {
+                editorFollowService();
+                editorRefreshTerminal();
+            } else if (editorPrefetchPending()) {
+                editorPrefetch(PREFETCH_SLICE_MS / 1000.0);
+            } else if (editorSymbolsPending()) {
+                editorSymbolsIndex(SYMBOLS_SLICE_MS / 1000.0);
+            } else {
+                editorWordsIndex(WORDS_SLICE_MS / 1000.0);
+            }
+            continue;
+        }
+        if (watch != -1 && (fds[watch].revents & POLLIN) && editorWatchService()) {
+            editorRefreshTerminal();
+        }
+        if (stream != -1 && fds[stream].revents) {
+            editorStreamService();
+            editorRefreshTerminal();
+        }
+        if (fds[0].revents) return;
+    }
+}
+
+int editorReadTerminalKey() {
     int nread;
     char ch;
 
+    editorWaitForKey();
+
     while ((nread = read(STDIN_FILENO, &ch, 1)) != 1) {
         if (nread == -1 && errno != EAGAIN) 
             die("read");
@@ -227,6 +882,32 @@ int editorReadKey() {
     
 }
 
+/* Keys of a macro, decoded. While recording, every key read is appended,
+prompt input included; while playing, keys come from the macro instead of
+the terminal, and an ESC ends a prompt the macro leaves open. */
+struct editorMacro {
+    int *keys;
+    int len;
+    int capacity;
+    int recording;
+    int playing;
+    int pos; // next key to play
+} M;
+
+int editorReadKey() {
+    if (M.playing) return M.pos < M.len ? M.keys[M.pos++] : '\x1b';
+
+    int c = editorReadTerminalKey();
+    if (M.recording) {
+        if (M.len == M.capacity) {
+            M.capacity = M.capacity ? M.capacity * 2 : 64;
+            M.keys = memRealloc(MEM_MACRO, M.keys, sizeof(int) * M.capacity);
+        }
+        M.keys[M.len++] = c;
+    }
+    return c;
+}
+
 int getCursorPosition(int *rows, int *cols) {
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
     
@@ -264,11 +945,14 @@ int is_separator(int c) {
   return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(editorrow *row) {
-    row->hl = realloc(row->hl, row->rsize);
+/* Generic highlighter, driven by the E.syntax entry at run time. Like the
+generated ones it returns whether the open comment state at the end of the
+row changed, in which case the next row has to be highlighted again. */
+int editorHighlightGeneric(editorrow *row) {
+    ST.syntaxRows++;
     memset(row->hl, HL_NORMAL, row->rsize);
 
-    if (E.syntax == NULL) return;
+    if (E.syntax == NULL) return 0;
 
     char **keywords = E.syntax->keywords;
 
@@ -282,7 +966,7 @@ void editorUpdateSyntax(editorrow *row) {
 
     int prev_sep = 1;
     int in_string = 0;
-    int in_comment = (row->idx > 0 && E.erow[row->idx - 1].hl_open_comment);
+    int in_comment = (row->idx > 0 && E.erow[row->idx - 1].hl_open_comment == 1);
 
     int i = 0;
     while (i < row->rsize) {
@@ -375,9 +1059,31 @@ void editorUpdateSyntax(editorrow *row) {
 
     int changed = (row->hl_open_comment != in_comment);
     row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows) {
-        editorUpdateSyntax(&E.erow[row->idx + 1]);
-    }    
+    return changed;
+}
+
+#include "hl_generated.h"
+
+void editorUpdateSyntax(editorrow *row) {
+    if (E.batch) {
+        editorBatchDefer(row->idx, row->idx);
+        return;
+    }
+    if (row->lazy) {
+        editorRowMaterialize(row);
+        return;
+    }
+    double start = ST.timing ? editorNow() : 0;
+    while (1) {
+        editorSymbolsStale(row);
+        if (!E.highlight(row) || row->idx + 1 >= E.numrows) break;
+        row = &E.erow[row->idx + 1]; // an open comment carries over
+        if (row->lazy) editorRenderRow(row);
+    }
+    if (ST.timing) {
+        ST.syntaxTime += editorNow() - start;
+        ST.syntaxCalls++;
+    }
 }
 
 int editorSyntaxToColor(int hl) {
@@ -403,6 +1109,7 @@ int editorSyntaxToColor(int hl) {
 
 void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
+    E.highlight = editorHighlightGeneric;
     if (E.filename == NULL) return;
     char *ext = strrchr(E.filename, '.');
     for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
@@ -413,6 +1120,7 @@ void editorSelectSyntaxHighlight() {
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
                 E.syntax = s;
+                E.highlight = editorGeneratedHighlighters[j];
 
                 int filerow;
                 for (filerow = 0; filerow < E.numrows; filerow++) {
@@ -426,9 +1134,239 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
+/*** word index ***/
+
+/* Every identifier of the buffer with its number of occurrences, for
+completion. The tokens of a row's text are removed before the text is
+written and added back when it is rendered, so the index follows edits
+without rescanning the buffer. Lazy rows are counted from their text while
+idle, from W.scan down. Entries live in a dense array, found through
+an open addressing table. Prefix queries binary search a name sorted array
+of entry indices; new entries are merged into it on the next query, and
+entries whose count dropped to 0 are kept until they outnumber the live
+ones, so retyping a word costs no allocation. */
+
+struct wordEntry {
+    char *word;
+    int len;
+    int count; // 0 once every occurrence is gone
+};
+
+struct editorWords {
+    struct wordEntry *entry;
+    int nentries;
+    int entrycap;
+    int *table; // entry index or -1, size is a power of 2
+    int tablesize;
+    int *sorted; // entry indices, by word
+    int nsorted;
+    int merged; // entries below this index are in sorted
+    int dead; // entries with count 0
+    int scan; // every row above this one is counted
+} W;
+
+int editorWordCompare(struct wordEntry *a, struct wordEntry *b) {
+    int n = a->len < b->len ? a->len : b->len;
+    int c = memcmp(a->word, b->word, n);
+    return c ? c : a->len - b->len;
+}
+
+void editorWordsRehash(int size) {
+    memFree(MEM_WORDS, W.table);
+    W.table = memAlloc(MEM_WORDS, size * sizeof(int));
+    memset(W.table, -1, size * sizeof(int));
+    W.tablesize = size;
+    for (int i = 0; i < W.nentries; i++) {
+        struct wordEntry *e = &W.entry[i];
+        unsigned h = editorHashLine(e->word, e->len) & (size - 1);
+        while (W.table[h] != -1) h = (h + 1) & (size - 1);
+        W.table[h] = i;
+    }
+}
+
+// drops the dead entries, the sorted array is rebuilt on the next query
+void editorWordsCompact() {
+    int n = 0;
+    for (int i = 0; i < W.nentries; i++) {
+        if (W.entry[i].count == 0) {
+            memFree(MEM_WORDS, W.entry[i].word);
+        } else {
+            W.entry[n++] = W.entry[i];
+        }
+    }
+    W.nentries = n;
+    W.dead = 0;
+    W.nsorted = 0;
+    W.merged = 0;
+    editorWordsRehash(W.tablesize);
+}
+
+void editorWordCount(char *s, int len, int delta) {
+    if (W.nentries * 2 >= W.tablesize) {
+        editorWordsRehash(W.tablesize ? W.tablesize * 2 : 1024);
+    }
+    unsigned h = editorHashLine(s, len) & (W.tablesize - 1);
+    while (W.table[h] != -1) {
+        struct wordEntry *e = &W.entry[W.table[h]];
+        if (e->len == len && !memcmp(e->word, s, len)) {
+            if (e->count == 0) W.dead--;
+            e->count += delta;
+            if (e->count == 0) W.dead++;
+            if (W.dead > 1024 && W.dead * 2 > W.nentries) editorWordsCompact();
+            return;
+        }
+        h = (h + 1) & (W.tablesize - 1);
+    }
+    if (delta < 0) return; // cannot happen while rows and index agree
+
+    if (W.nentries == W.entrycap) {
+        W.entrycap = W.entrycap ? W.entrycap * 2 : 1024;
+        W.entry = memRealloc(MEM_WORDS, W.entry, W.entrycap * sizeof(*W.entry));
+    }
+    char *word = memAlloc(MEM_WORDS, len);
+    memcpy(word, s, len);
+    W.entry[W.nentries] = (struct wordEntry){word, len, delta};
+    W.table[h] = W.nentries++;
+}
+
+/* Adds (delta 1) or removes (delta -1) the identifiers of the row's text,
+unless they already are or are not counted. Render holds the same ones,
+tabs only become spaces. */
+void editorWordsRow(editorrow *row, int delta) {
+    if (row->words == (delta > 0)) return;
+    row->words = delta > 0;
+    char *r = row->text;
+    int i = 0;
+    while (i < row->length) {
+        if (!isalpha((unsigned char)r[i]) && r[i] != '_') {
+            i++;
+            continue;
+        }
+        int start = i;
+        while (i < row->length && (isalnum((unsigned char)r[i]) || r[i] == '_')) i++;
+        if (i - start >= WORDS_MIN_LEN) editorWordCount(&r[start], i - start, delta);
+    }
+}
+
+// uncounts a row about to be written, a lazy one is counted again while idle
+void editorWordsStale(editorrow *row) {
+    editorWordsRow(row, -1);
+    if (row->lazy && row->idx < W.scan) W.scan = row->idx;
+}
+
+// delta rows were inserted at at, or -delta removed from at
+void editorWordsRowsMoved(int at, int delta) {
+    if (delta > 0 && at <= W.scan) W.scan += delta;
+    if (delta < 0 && at < W.scan) W.scan = W.scan + delta > at ? W.scan + delta : at;
+}
+
+int editorWordsPending() {
+    return W.scan < E.numrows;
+}
+
+// counts lazy rows from their text for up to budget seconds, returns whether any are left
+int editorWordsIndex(double budget) {
+    double start = editorNow();
+    while (W.scan < E.numrows) {
+        editorWordsRow(&E.erow[W.scan++], 1);
+        if ((W.scan & 255) == 0 && editorNow() - start > budget) break;
+    }
+    return editorWordsPending();
+}
+
+void editorWordsClear() {
+    for (int i = 0; i < W.nentries; i++) memFree(MEM_WORDS, W.entry[i].word);
+    W.nentries = 0;
+    W.nsorted = 0;
+    W.merged = 0;
+    W.dead = 0;
+    W.scan = 0;
+    if (W.table) memset(W.table, -1, W.tablesize * sizeof(int));
+}
+
+int editorWordIndexCompare(const void *a, const void *b) {
+    return editorWordCompare(&W.entry[*(const int *)a], &W.entry[*(const int *)b]);
+}
+
+// merges the entries added since the last query into the sorted array
+void editorWordsSort() {
+    if (W.merged >= W.nentries) return;
+    size_t fresh = W.nentries - W.merged;
+    W.sorted = memRealloc(MEM_WORDS, W.sorted, (size_t)W.nentries * sizeof(int));
+    int *add = &W.sorted[W.nsorted];
+    for (size_t i = 0; i < fresh; i++) add[i] = W.merged + i;
+    qsort(add, fresh, sizeof(int), editorWordIndexCompare);
+
+    // merge backwards in place, the fresh run sits right after the old one
+    int *tmp = memAlloc(MEM_WORDS, fresh * sizeof(int));
+    memcpy(tmp, add, fresh * sizeof(int));
+    int i = W.nsorted - 1, j = fresh - 1, k = W.nsorted + fresh - 1;
+    while (j >= 0) {
+        if (i >= 0 && editorWordCompare(&W.entry[W.sorted[i]], &W.entry[tmp[j]]) > 0) {
+            W.sorted[k--] = W.sorted[i--];
+        } else {
+            W.sorted[k--] = tmp[j--];
+        }
+    }
+    memFree(MEM_WORDS, tmp);
+    W.nsorted += fresh;
+    W.merged = W.nentries;
+}
+
+/* Fills out with up to max entries starting with prefix, most used first,
+leaving out prefix itself. Returns how many were found. */
+int editorWordsComplete(char *prefix, int len, int *out, int max) {
+    editorWordsSort();
+    struct wordEntry key = {prefix, len, 0};
+    int lo = 0, hi = W.nsorted;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (editorWordCompare(&W.entry[W.sorted[mid]], &key) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int n = 0;
+    for (int i = lo; i < W.nsorted; i++) {
+        struct wordEntry *e = &W.entry[W.sorted[i]];
+        if (e->len < len || memcmp(e->word, prefix, len)) break;
+        if (e->count == 0 || e->len == len) continue;
+
+        // keep the max most used, insertion sorted by count
+        int at = n < max ? n++ : max;
+        while (at > 0 && W.entry[out[at - 1]].count < e->count) {
+            if (at < max) out[at] = out[at - 1];
+            at--;
+        }
+        if (at < max) out[at] = W.sorted[i];
+    }
+    return n;
+}
+
 /*** row operations ***/
 
-void editorUpdateRow(editorrow * row) {
+// bytes taken by a row in the saved file, including its '\n'
+long long editorRowFileLength(int at) {
+    return E.erow[at].length + 1;
+}
+
+void editorLineIndexSync() {
+    if (E.lines.stale) {
+        rowIndexBuild(&E.lines, E.numrows, editorRowFileLength);
+    }
+}
+
+long long editorRowVisualLines(int at) {
+    return E.erow[at].nwrap + 1;
+}
+
+// byte offset of the start of row at in the saved file
+long long editorRowOffset(int at) {
+    editorLineIndexSync();
+    return rowIndexPrefix(&E.lines, at);
+}
+
+// rebuilds render from text, along with what depends on it but the highlighting
+void editorRenderRow(editorrow *row) {
     int tabs = 0;
     for (int i = 0 ; i < row->length ; i++) {
         if (row->text[i] == '\t') {
@@ -436,8 +1374,15 @@ void editorUpdateRow(editorrow * row) {
         }
     }
 
-    free(row->render);
-    row->render = malloc(row->length + tabs * (EDITOR_TAB - 1) + 1); // 1 char for tabs already counted in row.length
+    int size = row->length + tabs * (EDITOR_TAB - 1) + 1; // 1 char for tabs already counted in row.length
+    if (size > row->rcapacity) { // render and hl grow together, geometrically
+        row->rcapacity = row->rcapacity * 2 > size ? row->rcapacity * 2 : size;
+        if (row->rcapacity < 16) row->rcapacity = 16;
+        memFree(MEM_ROW_RENDER, row->render);
+        row->render = memAlloc(MEM_ROW_RENDER, row->rcapacity);
+        memFree(MEM_ROW_HL, row->hl);
+        row->hl = memAlloc(MEM_ROW_HL, row->rcapacity);
+    }
     
     int idx = 0;  
     for (int i = 0 ; i < row->length ; i++) {
@@ -453,8 +1398,79 @@ void editorUpdateRow(editorrow * row) {
 
     row->render[idx] = '\0';
     row->rsize = idx;
+    ST.lazyRendered += row->lazy;
+    row->lazy = 0;
+    editorWordsRow(row, 1);
+
+    rowIndexSet(&E.lines, row->idx, row->length + 1);
+    if (E.softWrap) {
+        editorRowWrap(row);
+        rowIndexSet(&E.vlines, row->idx, row->nwrap + 1);
+    }
+}
+
+void editorUpdateRow(editorrow * row) {
+    double start = ST.timing ? editorNow() : 0;
+
+    // the highlighter needs the comment state of the row above, so render
+    // the lazy rows up from the last one whose state is known; a new row
+    // can sit below lazy rows as well as a lazy one
+    int from = row->idx;
+    while (from > 0 && E.erow[from - 1].lazy && E.erow[from - 1].hl_open_comment == -1) from--;
+    for (int j = from; j < row->idx; j++) {
+        if (E.erow[j].lazy) editorUpdateRow(&E.erow[j]);
+    }
 
+    editorRenderRow(row);
     editorUpdateSyntax(row);
+
+    if (ST.timing) {
+        ST.updateRowTime += editorNow() - start;
+        ST.updateRowCalls++;
+    }
+}
+
+void editorRowMaterialize(editorrow *row) {
+    if (row->lazy) editorUpdateRow(row);
+}
+
+// grows E.erow geometrically to hold at least n rows
+void editorReserveRows(int n) {
+    if (n <= E.rowcap) return;
+    E.rowcap = E.rowcap ? E.rowcap * 2 : 64;
+    if (E.rowcap < n) E.rowcap = n;
+    E.erow = memRealloc(MEM_ROW_ARRAY, E.erow, sizeof(editorrow) * E.rowcap);
+}
+
+// frees row->text unless other rows still hold it
+void editorRowFreeText(editorrow *row) {
+    if (!row->shared || poolUnshare(&E.pool, row->text)) {
+        poolFree(&E.pool, row->text, row->capacity);
+    }
+    row->shared = 0;
+}
+
+/* Grows row->text geometrically to hold at least size bytes. Every write
+to the text goes through here first, so a shared text is copied then. */
+void editorRowReserve(editorrow *row, int size) {
+    row->origin = -1;
+    editorWordsStale(row);
+    if (row->shared) {
+        row->shared = 0;
+        if (!poolUnshare(&E.pool, row->text)) {
+            char *text = poolAlloc(&E.pool, size > row->length + 1 ? size : row->length + 1, &row->capacity);
+            memcpy(text, row->text, row->length + 1);
+            row->text = text;
+        }
+    }
+    if (size <= row->capacity) return;
+
+    int capacity = row->capacity * 2 > size ? row->capacity * 2 : size;
+    char *text = poolAlloc(&E.pool, capacity, &capacity);
+    memcpy(text, row->text, row->length + 1);
+    poolFree(&E.pool, row->text, row->capacity);
+    row->text = text;
+    row->capacity = capacity;
 }
 
 void editorInsertRow(int at, char *s, size_t len) {
@@ -462,22 +1478,37 @@ void editorInsertRow(int at, char *s, size_t len) {
         return ;
     }
     
-    E.erow = realloc(E.erow, sizeof(editorrow) * (E.numrows + 1));
+    editorReserveRows(E.numrows + 1);
     memmove(&E.erow[at+1], &E.erow[at], sizeof(editorrow) * (E.numrows - at));
     for (int j = at + 1; j <= E.numrows; j++) {
         E.erow[j].idx++;
     }
     E.erow[at].idx = at;
+    editorSymbolsInserted(at, 1);
+    editorBatchRowsMoved(at, 1);
+    editorWordsRowsMoved(at, 1);
 
     E.erow[at].length = len; // excluding '\0' at the end of string
-    E.erow[at].text = malloc(len + 1);
-    memcpy(E.erow[at].text, s, len+1);
+    E.erow[at].text = poolAlloc(&E.pool, len + 1, &E.erow[at].capacity);
+    memcpy(E.erow[at].text, s, len);
+    E.erow[at].text[len] = '\0';
     
     E.erow[at].render = NULL;
+    E.erow[at].rcapacity = 0;
     E.erow[at].hl = NULL;
 
     E.erow[at].rsize = 0;
     E.erow[at].hl_open_comment = 0;
+    E.erow[at].wrap = NULL;
+    E.erow[at].nwrap = 0;
+    E.erow[at].symbols = 0;
+    E.erow[at].lazy = 0;
+    E.erow[at].shared = 0;
+    E.erow[at].origin = -1;
+    E.erow[at].words = 0;
+
+    rowIndexInserted(&E.lines, at, 1, editorRowFileLength);
+    rowIndexInserted(&E.vlines, at, 1, editorRowVisualLines);
     editorUpdateRow(&E.erow[at]);
 
     E.numrows++;
@@ -514,7 +1545,7 @@ void editorRowInsertChar(editorrow* erow, int at, char c) {
         at = erow->length;
     }
 
-    erow->text = realloc(erow->text, erow->length + 2);
+    editorRowReserve(erow, erow->length + 2);
     memmove(&erow->text[at+1], &erow->text[at], erow->length - at + 1);
     erow->length++;
     erow->text[at] = c;
@@ -527,6 +1558,7 @@ void editorRowDelChar(editorrow* erow, int at) {
         return;
     }
 
+    editorRowReserve(erow, erow->length + 1);
     memmove(&erow->text[at], &erow->text[at+1], erow->length - at);
     erow->length--;
     editorUpdateRow(erow);
@@ -534,9 +1566,38 @@ void editorRowDelChar(editorrow* erow, int at) {
 }
 
 void editorFreeRow(editorrow *row) {
-    free(row->text);
-    free(row->render);
-    free(row->hl);
+    editorWordsRow(row, -1);
+    editorRowFreeText(row);
+    memFree(MEM_ROW_RENDER, row->render);
+    memFree(MEM_ROW_HL, row->hl);
+    memFree(MEM_WRAP, row->wrap);
+}
+
+/* Drops every row, releasing the text slabs in bulk rather than row by row.
+The clipboard goes too, its rows may hold text from the slabs. */
+void editorCloseBuffer() {
+    editorClipboardClear();
+    editorHexClose();
+    for (int j = 0; j < E.numrows; j++) {
+        editorrow *row = &E.erow[j];
+        if (row->capacity > POOL_MAX_BLOCK) editorRowFreeText(row);
+        memFree(MEM_ROW_RENDER, row->render);
+        memFree(MEM_ROW_HL, row->hl);
+        memFree(MEM_WRAP, row->wrap);
+    }
+    poolRelease(&E.pool);
+    editorSymbolsClear();
+    editorWordsClear();
+    memFree(MEM_ROW_ARRAY, E.erow);
+    E.erow = NULL;
+    E.rowcap = 0;
+    E.numrows = 0;
+    rowIndexFree(&E.lines);
+    E.vlines.stale = 1;
+    memset(&E.origin, 0, sizeof(E.origin));
+    E.cursorX = E.cursorY = 0;
+    E.rowOff = E.colOff = E.wrapOff = 0;
+    E.dirty = 0;
 }
 
 void editorDelRow(int at) {
@@ -544,24 +1605,347 @@ void editorDelRow(int at) {
         return;
     }
 
+    rowIndexRemoved(&E.lines, at, 1, E.numrows);
+    rowIndexRemoved(&E.vlines, at, 1, E.numrows);
+    editorSymbolsRemoved(at, 1);
+
     editorFreeRow(&E.erow[at]);
     memmove(&E.erow[at], &E.erow[at+1], sizeof(editorrow) * (E.numrows - at - 1));
     for (int j = at; j < E.numrows - 1; j++) {
         E.erow[j].idx--;
     }
     E.numrows--;
+    editorBatchRowsMoved(at, -1);
+    editorWordsRowsMoved(at, -1);
     E.dirty++;
 }
 
-void editorRowAppendString(editorrow * row, char* s, size_t len) {
-    row->text = realloc(row->text, row->length + len + 1); // +1 for null char
-    memcpy(&row->text[row->length], s, len);
+// opens a gap of count empty rows at at, the caller must set their text
+void editorInsertRows(int at, int count) {
+    if (at < 0 || at > E.numrows || count <= 0) {
+        return;
+    }
+
+    editorReserveRows(E.numrows + count);
+    memmove(&E.erow[at + count], &E.erow[at], sizeof(editorrow) * (E.numrows - at));
+    for (int j = at + count; j < E.numrows + count; j++) {
+        E.erow[j].idx += count;
+    }
+    editorSymbolsInserted(at, count);
+    editorBatchRowsMoved(at, count);
+    editorWordsRowsMoved(at, count);
+    for (int j = at; j < at + count; j++) {
+        editorrow *row = &E.erow[j];
+        row->idx = j;
+        row->length = 0;
+        row->text = poolAlloc(&E.pool, 1, &row->capacity);
+        row->text[0] = '\0';
+        row->rsize = 0;
+        row->render = NULL;
+        row->rcapacity = 0;
+        row->hl = NULL;
+        row->hl_open_comment = 0;
+        row->wrap = NULL;
+        row->nwrap = 0;
+        row->symbols = 0;
+        row->lazy = 0;
+        row->shared = 0;
+        row->origin = -1;
+        row->words = 0;
+    }
+
+    rowIndexInserted(&E.lines, at, count, editorRowFileLength);
+    rowIndexInserted(&E.vlines, at, count, editorRowVisualLines);
+    E.numrows += count;
+    E.dirty++;
+}
+
+void editorDelRows(int at, int count) {
+    if (at < 0 || count <= 0 || at + count > E.numrows) {
+        return;
+    }
+
+    rowIndexRemoved(&E.lines, at, count, E.numrows);
+    rowIndexRemoved(&E.vlines, at, count, E.numrows);
+    editorSymbolsRemoved(at, count);
+
+    for (int j = at; j < at + count; j++) {
+        editorFreeRow(&E.erow[j]);
+    }
+    memmove(&E.erow[at], &E.erow[at + count], sizeof(editorrow) * (E.numrows - at - count));
+    for (int j = at; j < E.numrows - count; j++) {
+        E.erow[j].idx -= count;
+    }
+    E.numrows -= count;
+    editorBatchRowsMoved(at, -count);
+    editorWordsRowsMoved(at, -count);
+    E.dirty++;
+}
+
+/* Moves rows [at, at + count) out of the buffer into out, render and
+highlighting included; only the row structs are copied. The caller fixes
+the highlighting of the rows that come together, see editorRowsJoined.
+The rows lose their origin: by the time they come back the file may have
+been saved or reloaded, and their offsets would point into another file. */
+void editorDetachRows(int at, int count, editorrow *out) {
+    if (at < 0 || count <= 0 || at + count > E.numrows) {
+        return;
+    }
+
+    rowIndexRemoved(&E.lines, at, count, E.numrows);
+    rowIndexRemoved(&E.vlines, at, count, E.numrows);
+    editorSymbolsRemoved(at, count);
+
+    memcpy(out, &E.erow[at], sizeof(editorrow) * count);
+    for (int j = 0; j < count; j++) {
+        out[j].symbols = 0;
+        out[j].origin = -1;
+    }
+    memmove(&E.erow[at], &E.erow[at + count], sizeof(editorrow) * (E.numrows - at - count));
+    for (int j = at; j < E.numrows - count; j++) {
+        E.erow[j].idx -= count;
+    }
+    E.numrows -= count;
+    editorBatchRowsMoved(at, -count);
+    editorWordsRowsMoved(at, -count);
+    E.dirty++;
+}
+
+// moves count rows detached by editorDetachRows back in at at
+void editorAttachRows(int at, editorrow *rows, int count) {
+    if (at < 0 || at > E.numrows || count <= 0) {
+        return;
+    }
+
+    editorReserveRows(E.numrows + count);
+    memmove(&E.erow[at + count], &E.erow[at], sizeof(editorrow) * (E.numrows - at));
+    for (int j = at + count; j < E.numrows + count; j++) {
+        E.erow[j].idx += count;
+    }
+    editorSymbolsInserted(at, count);
+    editorBatchRowsMoved(at, count);
+    editorWordsRowsMoved(at, count);
+    memcpy(&E.erow[at], rows, sizeof(editorrow) * count);
+    for (int j = at; j < at + count; j++) {
+        editorrow *row = &E.erow[j];
+        row->idx = j;
+        if (E.softWrap && !row->lazy) editorRowWrap(row); // the width may have changed since
+        editorSymbolsStale(row);
+    }
+    if (at < W.scan) W.scan = at; // lazy rows come in uncounted
+
+    rowIndexInserted(&E.lines, at, count, editorRowFileLength);
+    rowIndexInserted(&E.vlines, at, count, editorRowVisualLines);
+    E.numrows += count;
+    if (E.softWrap) { // lazy rows have no visual line count
+        for (int j = at; j < at + count; j++) editorRowMaterialize(&E.erow[j]);
+    }
+    E.dirty++;
+}
+
+void editorRowSetText(editorrow *row, char *s, size_t len) {
+    row->origin = -1;
+    editorWordsStale(row);
+    if (row->shared || (int)len + 1 > row->capacity) {
+        editorRowFreeText(row);
+        row->text = poolAlloc(&E.pool, len + 1, &row->capacity);
+    }
+    memcpy(row->text, s, len);
+    row->text[len] = '\0';
+    row->length = len;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+// replaces the len chars at at with the slen chars of s
+void editorRowReplace(editorrow *row, int at, int len, char *s, int slen) {
+    editorRowReserve(row, row->length - len + slen + 1);
+    memmove(&row->text[at + slen], &row->text[at + len], row->length - at - len + 1);
+    memcpy(&row->text[at], s, slen);
+    row->length += slen - len;
+    editorUpdateRow(row);
+    E.dirty++;
+}
+
+/* Highlights rows [at, at + count) top down in a single pass; only the
+last one carries its comment state on to the rows below. */
+void editorHighlightRows(int at, int count) {
+    if (E.batch) {
+        editorBatchDefer(at, at + count - 1);
+        return;
+    }
+    double start = ST.timing ? editorNow() : 0;
+    for (int j = at; j < at + count - 1; j++) {
+        if (E.erow[j].lazy) editorRenderRow(&E.erow[j]);
+        editorSymbolsStale(&E.erow[j]);
+        E.highlight(&E.erow[j]);
+    }
+    if (ST.timing) ST.syntaxTime += editorNow() - start;
+    if (count > 0) editorUpdateSyntax(&E.erow[at + count - 1]);
+}
+
+// renders rows [at, at + count) after their text was changed in place, then highlights them
+void editorUpdateRows(int at, int count) {
+    for (int j = at; j < at + count; j++) {
+        editorRenderRow(&E.erow[j]);
+    }
+    editorHighlightRows(at, count);
+    E.dirty++;
+}
+
+// comment state at the end of row at, which is highlighted if it is not known
+int editorOpenAfter(int at) {
+    if (E.erow[at].hl_open_comment == -1) editorRowMaterialize(&E.erow[at]);
+    return E.erow[at].hl_open_comment;
+}
+
+int editorOpenBefore(int at) {
+    return at > 0 ? editorOpenAfter(at - 1) : 0;
+}
+
+/* Row at was highlighted after a row ending in comment state was and now
+has another row above. Highlights it again, and what that carries on to,
+when the new row above ends otherwise. */
+void editorRowsJoined(int at, int was) {
+    if (at < E.numrows && (E.batch || editorOpenBefore(at) != was)) {
+        editorUpdateSyntax(&E.erow[at]);
+    }
+}
+
+void editorRowAppendString(editorrow * row, char* s, size_t len) {
+    editorRowReserve(row, row->length + len + 1); // +1 for null char
+    memcpy(&row->text[row->length], s, len);
     row->length += len;
     row->text[row->length] = '\0';
     editorUpdateRow(row);
     E.dirty++;
 }
 
+/*** soft wrap ***/
+
+/* In soft wrap mode each row caches the render offsets where its visual
+lines break, recomputed by editorUpdateRow when the row changes. E.vlines
+holds the visual line count of every row, so mapping between file rows and
+screen lines is a prefix sum or a search, O(log n), with no re-wrapping. */
+
+// breaks row->render into visual lines of at most E.screencols, at spaces when possible
+void editorRowWrap(editorrow *row) {
+    int width = E.screencols;
+    int start = 0, cap = 0;
+
+    row->nwrap = 0;
+    while (width > 0 && row->rsize - start >= width) {
+        int brk = start + width;
+        for (int i = start + width; i > start; i--) {
+            if (row->render[i - 1] == ' ') {
+                brk = i;
+                break;
+            }
+        }
+        if (row->nwrap == cap) {
+            cap = cap ? cap * 2 : 4;
+            row->wrap = memRealloc(MEM_WRAP, row->wrap, sizeof(int) * cap);
+        }
+        row->wrap[row->nwrap++] = brk;
+        start = brk;
+    }
+}
+
+void editorWrapSync() {
+    if (E.vlines.stale) {
+        rowIndexBuild(&E.vlines, E.numrows, editorRowVisualLines);
+    }
+}
+
+int editorWrapStart(editorrow *row, int sub) {
+    return sub == 0 ? 0 : row->wrap[sub - 1];
+}
+
+int editorWrapEnd(editorrow *row, int sub) {
+    return sub < row->nwrap ? row->wrap[sub] : row->rsize;
+}
+
+// visual line of row containing render column rx
+int editorWrapSubLine(editorrow *row, int rx) {
+    int sub = 0;
+    while (sub < row->nwrap && row->wrap[sub] <= rx) sub++;
+    return sub;
+}
+
+// visual line of the cursor counted from the top of the file
+long long editorWrapCursorLine() {
+    editorWrapSync();
+    long long line = rowIndexPrefix(&E.vlines, E.cursorY);
+    if (E.cursorY < E.numrows) {
+        editorrow *row = &E.erow[E.cursorY];
+        line += editorWrapSubLine(row, editorRowCursorXToRenderX(row, E.cursorX));
+    }
+    return line;
+}
+
+// row and visual line in that row for a visual line counted from the top of the file
+void editorWrapLocate(long long line, int *row, int *sub) {
+    editorWrapSync();
+    *row = rowIndexSearch(&E.vlines, line);
+    *sub = 0;
+    if (*row < E.numrows) {
+        *sub = line - rowIndexPrefix(&E.vlines, *row);
+    }
+}
+
+// moves the cursor to visual line, col render columns into it
+void editorWrapGotoLine(long long line, int col) {
+    long long total = rowIndexPrefix(&E.vlines, E.numrows);
+    if (line < 0) line = 0;
+    if (line > total) line = total;
+
+    int row, sub;
+    editorWrapLocate(line, &row, &sub);
+    E.cursorY = row;
+    E.cursorX = 0;
+    if (row < E.numrows) {
+        editorrow *erow = &E.erow[row];
+        int start = editorWrapStart(erow, sub), end = editorWrapEnd(erow, sub);
+        int rx = start + col;
+        if (sub < erow->nwrap && rx >= end) rx = end - 1; // stay on this visual line
+        E.cursorX = rx >= erow->rsize ? erow->length : editorRowRenderCToCursorX(erow, rx);
+    }
+}
+
+void editorWrapMoveCursor(int dir) {
+    long long line = editorWrapCursorLine();
+    int col = 0;
+    if (E.cursorY < E.numrows) {
+        editorrow *row = &E.erow[E.cursorY];
+        int rx = editorRowCursorXToRenderX(row, E.cursorX);
+        col = rx - editorWrapStart(row, editorWrapSubLine(row, rx));
+    }
+    if (line + dir < 0) return;
+    editorWrapGotoLine(line + dir, col);
+}
+
+// first visual line on screen counted from the top of the file
+long long editorWrapTopLine() {
+    editorWrapSync();
+    return rowIndexPrefix(&E.vlines, E.rowOff) + E.wrapOff;
+}
+
+void editorToggleSoftWrap() {
+    E.softWrap = !E.softWrap;
+    E.wrapOff = 0;
+    if (E.softWrap) {
+        for (int i = 0; i < E.numrows; i++) {
+            editorRowMaterialize(&E.erow[i]); // every row's visual line count is needed
+            editorRowWrap(&E.erow[i]);
+        }
+        rowIndexBuild(&E.vlines, E.numrows, editorRowVisualLines);
+        E.colOff = 0;
+    } else {
+        E.vlines.stale = 1; // not maintained until wrapping is back on
+    }
+    editorSetStatusMessage("Soft wrap %s", E.softWrap ? "on" : "off");
+}
+
 /*** editor operations ***/
 
 void editorInsertChar(int c) {
@@ -597,6 +1981,7 @@ void editorInsertNewLine() {
         editorrow *row = &E.erow[E.cursorY];
         editorInsertRow(E.cursorY+1, &row->text[E.cursorX], row->length - E.cursorX);
         row = &E.erow[E.cursorY]; // reassign as editorInsertRow reallocates E.erow pointer
+        editorRowReserve(row, E.cursorX + 1);
         row->length = E.cursorX;
         row->text[row->length] = '\0';
         editorUpdateRow(row);
@@ -606,174 +1991,3104 @@ void editorInsertNewLine() {
     E.cursorY++;
 }
 
-/*** file I/O ***/
+/* Completes the identifier before the cursor with the most used words of
+the buffer sharing its prefix. Pressing it again right after cycles through
+them, and back to what was typed. */
+void editorComplete() {
+    static char *words[COMPLETE_MAX];
+    static int nwords = 0, current, start, plen, row_at = -1, end;
 
-void editorOpen(char * file) {
-    free(E.filename);
-    E.filename = strdup(file);
+    if (E.cursorY >= E.numrows) return;
+    editorrow *row = &E.erow[E.cursorY];
 
-    editorSelectSyntaxHighlight();
+    int cycling = nwords && row_at == E.cursorY && end == E.cursorX && end <= row->length &&
+        (current == nwords || (end - start == (int)strlen(words[current]) &&
+        !memcmp(&row->text[start], words[current], end - start)));
+    if (!cycling) {
+        for (int i = 0; i < nwords; i++) memFree(MEM_WORDS, words[i]);
+        nwords = 0;
 
-    FILE *fp = fopen(file, "r");
-    if (!fp) {
-        die("fopen");
+        start = E.cursorX;
+        while (start > 0 && (isalnum((unsigned char)row->text[start - 1]) || row->text[start - 1] == '_')) {
+            start--;
+        }
+        plen = E.cursorX - start;
+        if (plen == 0) return;
+        editorWordsIndex(1e9); // finish what the background indexing left
+
+        int found[COMPLETE_MAX];
+        int n = editorWordsComplete(&row->text[start], plen, found, COMPLETE_MAX);
+        if (n == 0) {
+            editorSetStatusMessage("No completion for %.*s", plen, &row->text[start]);
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            struct wordEntry *e = &W.entry[found[i]];
+            words[i] = memAlloc(MEM_WORDS, e->len + 1);
+            memcpy(words[i], e->word, e->len);
+            words[i][e->len] = '\0';
+        }
+        nwords = n;
+        current = -1;
+        row_at = E.cursorY;
     }
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen - 1] == '\r')) {
-            linelen--;
+    current = (current + 1) % (nwords + 1); // nwords stands for the typed prefix
+    int len = current < nwords ? strlen(words[current]) - plen : 0;
+    editorRowReplace(row, start + plen, E.cursorX - start - plen,
+        current < nwords ? words[current] + plen : "", len);
+    E.cursorX = end = start + plen + len;
+
+    if (current < nwords) {
+        editorSetStatusMessage("Completion %d of %d", current + 1, nwords);
+    } else {
+        editorSetStatusMessage("Back to the typed prefix");
+    }
+}
+
+/*** selection ***/
+
+/* In block selection the rectangle spans the rows between the anchor and
+the cursor, and the render columns between them. Edits apply to every row
+of it as one batch: the text of all rows is changed first, then they are
+rendered and highlighted once, top down, by editorUpdateRows. */
+
+// the selected rows and render columns [*c0, *c1), 0 when there is no block
+int editorBlockBounds(int *y0, int *y1, int *c0, int *c1) {
+    if (E.selection != SELECT_BLOCK || E.numrows == 0) return 0;
+    int cy = E.cursorY < E.numrows ? E.cursorY : E.numrows - 1;
+    int ay = E.selAnchorY < E.numrows ? E.selAnchorY : E.numrows - 1;
+    *y0 = ay < cy ? ay : cy;
+    *y1 = ay < cy ? cy : ay;
+    *c0 = E.selAnchorX < E.selCursorX ? E.selAnchorX : E.selCursorX;
+    *c1 = E.selAnchorX < E.selCursorX ? E.selCursorX : E.selAnchorX;
+    return 1;
+}
+
+/* The cursor side column follows horizontal moves only, so moving through
+a short row does not narrow the block. */
+void editorBlockMoved(int c) {
+    if (c == ARROW_LEFT || c == ARROW_RIGHT || c == HOME_KEY || c == END_KEY) {
+        E.selCursorX = E.cursorY < E.numrows ? editorRowCursorXToRenderX(&E.erow[E.cursorY], E.cursorX) : 0;
+    }
+}
+
+// render columns [*s0, *s1) of row to draw selected
+void editorSelectionSpan(editorrow *row, int *s0, int *s1) {
+    int y0, y1, c0, c1;
+    *s0 = *s1 = 0;
+    if (editorBlockBounds(&y0, &y1, &c0, &c1) && row->idx >= y0 && row->idx <= y1) {
+        *s0 = c0;
+        *s1 = c1;
+    } else if (editorSelectionBounds(&y0, &c0, &y1, &c1) && row->idx >= y0 && row->idx <= y1) {
+        *s0 = row->idx == y0 ? editorRowCursorXToRenderX(row, c0) : 0;
+        *s1 = row->idx == y1 ? editorRowCursorXToRenderX(row, c1) : row->rsize;
+    }
+}
+
+/* Replaces render columns [c0, c1) of rows [y0, y1] with s. Rows ending
+before c0 are padded with spaces when s is not empty. */
+void editorBlockReplace(int y0, int y1, int c0, int c1, char *s, int slen) {
+    for (int y = y0; y <= y1; y++) {
+        editorRowMaterialize(&E.erow[y]);
+    }
+    for (int y = y0; y <= y1; y++) {
+        editorrow *row = &E.erow[y];
+        int pad = slen && row->rsize < c0 ? c0 - row->rsize : 0;
+        int a = editorRowRenderCToCursorX(row, c0), b = editorRowRenderCToCursorX(row, c1);
+        editorRowReserve(row, row->length + pad + slen - (b - a) + 1);
+        memmove(&row->text[b + pad + slen - (b - a)], &row->text[b], row->length - b + 1);
+        memset(&row->text[a], ' ', pad);
+        memcpy(&row->text[a + pad], s, slen);
+        row->length += pad + slen - (b - a);
+    }
+    editorUpdateRows(y0, y1 - y0 + 1);
+}
+
+// handles c in block selection, returns 0 for keys that move the cursor as usual
+int editorBlockKey(int c) {
+    int y0, y1, c0, c1;
+    if (c == '\x1b' || c == CTRL_KEY('b') || c == '\r') {
+        E.selection = SELECT_NONE;
+        editorSetStatusMessage("");
+        return 1;
+    }
+    if (!editorBlockBounds(&y0, &y1, &c0, &c1)) return 0;
+
+    if (c == BACKSPACE || c == CTRL_KEY('h') || c == DEL_KEY) {
+        if (c0 == c1) { // no columns selected, delete the char before or under
+            if (c == DEL_KEY) {
+                c1++;
+            } else if (c0 > 0) {
+                c0--;
+            } else {
+                return 1;
+            }
+        }
+        editorBlockReplace(y0, y1, c0, c1, "", 0);
+    } else if (!iscntrl(c) && c < 128) {
+        char ch = c;
+        editorBlockReplace(y0, y1, c0, c1, &ch, 1);
+        c0++;
+    } else {
+        return 0;
+    }
+
+    // collapse to an insertion column at c0 on every row
+    E.selAnchorX = E.selCursorX = c0;
+    if (E.cursorY < E.numrows) {
+        E.cursorX = editorRowRenderCToCursorX(&E.erow[E.cursorY], c0);
+    }
+    return 1;
+}
+
+void editorBlockSelect() {
+    E.selection = SELECT_BLOCK;
+    E.selAnchorY = E.cursorY;
+    E.selAnchorX = E.cursorY < E.numrows ? editorRowCursorXToRenderX(&E.erow[E.cursorY], E.cursorX) : 0;
+    E.selCursorX = E.selAnchorX;
+    editorSetStatusMessage("Block selection: type to insert, Backspace/Del to delete, ESC to leave");
+}
+
+/* A char or line selection runs from the anchor to the cursor. Cutting
+whole rows moves their structs into the clipboard, text, render and
+highlighting included, and pasting moves them back; copying makes lazy
+rows sharing the text. Either way only the rows where the text comes
+together are highlighted again, and what their comment state carries on
+to. A charwise clip keeps the partial first and last rows as text only. */
+
+struct editorClipboard {
+    editorrow *rows; // out of the buffer, their idx is meaningless
+    int nrows;
+    int capacity;
+    int linewise;
+    int openBefore; // comment state the first whole row was highlighted after
+} C;
+
+void editorClipboardClear() {
+    for (int j = 0; j < C.nrows; j++) {
+        editorFreeRow(&C.rows[j]);
+    }
+    C.nrows = 0;
+}
+
+void editorClipboardReserve(int n) {
+    if (n <= C.capacity) return;
+    C.capacity = n;
+    C.rows = memRealloc(MEM_CLIPBOARD, C.rows, sizeof(editorrow) * n);
+}
+
+// makes *row a lazy row holding a copy of s
+void editorClipText(editorrow *row, char *s, int len) {
+    memset(row, 0, sizeof(*row));
+    row->length = len;
+    row->text = poolAlloc(&E.pool, len + 1, &row->capacity);
+    memcpy(row->text, s, len);
+    row->text[len] = '\0';
+    row->hl_open_comment = -1;
+    row->lazy = 1;
+    row->origin = -1;
+}
+
+// makes *dst a lazy row sharing the text of src
+void editorRowShare(editorrow *dst, editorrow *src) {
+    memset(dst, 0, sizeof(*dst));
+    poolShare(&E.pool, src->text);
+    dst->length = src->length;
+    dst->text = src->text;
+    dst->capacity = src->capacity;
+    dst->shared = src->shared = 1;
+    dst->hl_open_comment = src->hl_open_comment; // still true after openBefore
+    dst->lazy = 1;
+    dst->origin = -1; // may be pasted after a save, when the offset means another file
+}
+
+// moves clipboard rows [from, from + count) in at at, leaving shared copies for the next paste
+void editorPasteRows(int at, int from, int count) {
+    editorAttachRows(at, &C.rows[from], count);
+    for (int j = 0; j < count; j++) {
+        editorRowShare(&C.rows[from + j], &E.erow[at + j]);
+    }
+}
+
+// ordered ends of the char or line selection, with the cursor kept inside the text
+int editorSelectionBounds(int *y0, int *x0, int *y1, int *x1) {
+    if ((E.selection != SELECT_CHAR && E.selection != SELECT_LINE) || E.numrows == 0) return 0;
+    int cy = E.cursorY, cx = E.cursorX;
+    int ay = E.selAnchorY, ax = E.selAnchorX;
+    if (cy >= E.numrows) {
+        cy = E.numrows - 1;
+        cx = E.erow[cy].length;
+    }
+    if (ay >= E.numrows) {
+        ay = E.numrows - 1;
+        ax = E.erow[ay].length;
+    }
+    if (ax > E.erow[ay].length) ax = E.erow[ay].length;
+
+    int before = ay < cy || (ay == cy && ax < cx);
+    *y0 = before ? ay : cy;
+    *x0 = before ? ax : cx;
+    *y1 = before ? cy : ay;
+    *x1 = before ? cx : ax;
+    if (E.selection == SELECT_LINE) {
+        *x0 = 0;
+        *x1 = E.erow[*y1].length;
+    }
+    return 1;
+}
+
+// cuts or copies the whole rows [at, at + count)
+void editorClipLines(int at, int count, int cut) {
+    editorClipboardReserve(count);
+    C.linewise = 1;
+    C.nrows = count;
+    C.openBefore = editorOpenBefore(at);
+    if (cut) {
+        int was = editorOpenAfter(at + count - 1);
+        editorDetachRows(at, count, C.rows);
+        editorRowsJoined(at, was);
+        E.cursorY = at;
+        E.cursorX = 0;
+    } else {
+        for (int j = 0; j < count; j++) {
+            editorRowShare(&C.rows[j], &E.erow[at + j]);
+        }
+    }
+}
+
+// cuts or copies the text from (y0, x0) to (y1, x1)
+void editorClipChars(int y0, int x0, int y1, int x1, int cut) {
+    int n = y1 - y0 + 1;
+    editorClipboardReserve(n);
+    C.linewise = 0;
+    C.nrows = n;
+    if (n == 1) {
+        editorClipText(&C.rows[0], &E.erow[y0].text[x0], x1 - x0);
+        if (cut) editorRowReplace(&E.erow[y0], x0, x1 - x0, "", 0);
+    } else {
+        editorClipText(&C.rows[0], &E.erow[y0].text[x0], E.erow[y0].length - x0);
+        editorClipText(&C.rows[n - 1], E.erow[y1].text, x1);
+        C.openBefore = editorOpenAfter(y0);
+        if (cut) {
+            int was = editorOpenAfter(y1);
+            editorDetachRows(y0 + 1, n - 2, &C.rows[1]);
+
+            // join what is left of the first and last rows
+            editorrow *last = &E.erow[y0 + 1];
+            int taillen = last->length - x1;
+            char *tail = malloc(taillen + 1);
+            memcpy(tail, &last->text[x1], taillen);
+            editorDelRow(y0 + 1);
+            editorRowReplace(&E.erow[y0], x0, E.erow[y0].length - x0, tail, taillen);
+            free(tail);
+            editorRowsJoined(y0 + 1, was);
+        } else {
+            for (int j = 1; j < n - 1; j++) {
+                editorRowShare(&C.rows[j], &E.erow[y0 + j]);
+            }
+        }
+    }
+    if (cut) {
+        E.cursorY = y0;
+        E.cursorX = x0;
+    }
+}
+
+// copies (cut 0) or cuts the selection, or the cursor row when nothing is selected
+void editorClip(int cut) {
+    int y0, x0, y1, x1;
+    int linewise = E.selection != SELECT_CHAR;
+    if (!editorSelectionBounds(&y0, &x0, &y1, &x1)) {
+        if (E.cursorY >= E.numrows) return;
+        y0 = y1 = E.cursorY;
+        linewise = 1;
+    }
+    E.selection = SELECT_NONE;
+
+    editorClipboardClear();
+    if (linewise) {
+        editorClipLines(y0, y1 - y0 + 1, cut);
+        editorSetStatusMessage("%s %d line(s)", cut ? "Cut" : "Copied", y1 - y0 + 1);
+    } else {
+        editorClipChars(y0, x0, y1, x1, cut);
+        editorSetStatusMessage("%s %d line(s) of text", cut ? "Cut" : "Copied", y1 - y0 + 1);
+    }
+}
+
+/* Pastes a charwise clip of several rows by splitting the cursor row: its
+tail goes on a new row after the last piece. That row stays lazy until it
+is highlighted, with the comment state the row below it was highlighted
+after, so highlighting it carries a change on exactly when needed. */
+void editorPasteChars() {
+    int n = C.nrows;
+    int y = E.cursorY, x = E.cursorX;
+    int was = editorOpenAfter(y);
+    editorrow *piece = &C.rows[n - 1];
+    int taillen = E.erow[y].length - x;
+
+    editorInsertRows(y + 1, 1);
+    editorrow *row = &E.erow[y], *last = &E.erow[y + 1];
+    editorRowReserve(last, piece->length + taillen + 1);
+    memcpy(last->text, piece->text, piece->length);
+    memcpy(&last->text[piece->length], &row->text[x], taillen);
+    last->length = piece->length + taillen;
+    last->text[last->length] = '\0';
+    last->hl_open_comment = was;
+    last->lazy = 1;
+    if (last->idx < W.scan) W.scan = last->idx;
+
+    if (n > 2) editorPasteRows(y + 1, 1, n - 2);
+    editorRowReplace(&E.erow[y], x, taillen, C.rows[0].text, C.rows[0].length);
+    if (n > 2) editorRowsJoined(y + 1, C.openBefore);
+    editorRowMaterialize(&E.erow[y + n - 1]);
+    E.cursorY = y + n - 1;
+    E.cursorX = piece->length;
+}
+
+// inserts the clipboard at the cursor, whole rows above the cursor row
+void editorPaste() {
+    int n = C.nrows;
+    if (n == 0) return;
+
+    if (C.linewise) {
+        int at = E.cursorY;
+        int was = editorOpenBefore(at); // what the cursor row was highlighted after
+        editorPasteRows(at, 0, n);
+        editorRowsJoined(at, C.openBefore);
+        editorRowsJoined(at + n, was);
+        E.cursorY += n;
+        E.cursorX = 0;
+        editorSetStatusMessage("Pasted %d line(s)", n);
+        return;
+    }
+
+    if (E.cursorY == E.numrows) editorInsertRow(E.numrows, "", 0);
+    if (n == 1) {
+        editorRowReplace(&E.erow[E.cursorY], E.cursorX, 0, C.rows[0].text, C.rows[0].length);
+        E.cursorX += C.rows[0].length;
+    } else {
+        editorPasteChars();
+    }
+}
+
+void editorSelect(int mode) {
+    if (E.selection == mode) {
+        E.selection = SELECT_NONE;
+        editorSetStatusMessage("");
+        return;
+    }
+    if (E.selection != SELECT_CHAR && E.selection != SELECT_LINE) {
+        E.selAnchorY = E.cursorY;
+        E.selAnchorX = E.cursorX;
+    }
+    E.selection = mode;
+    editorSetStatusMessage("%s selection: move to extend, Ctrl-C copy, Ctrl-X cut, ESC to leave",
+        mode == SELECT_LINE ? "Line" : "Char");
+}
+
+// keys moving the cursor extend a char or line selection, the others end it
+void editorSelectKey(int c) {
+    switch (c) {
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case HOME_KEY:
+        case END_KEY:
+        case CTRL_KEY('c'):
+        case CTRL_KEY('x'):
+        case CTRL_KEY('e'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('p'): // replays on each selected line
+        case CTRL_KEY('u'): // filters the selected lines
+            return;
+    }
+    E.selection = SELECT_NONE;
+}
+
+/*** hex view ***/
+
+/* Binary files are shown as a hex dump drawn straight from a read only
+mapping of the file: only the rows on screen are formatted, through lookup
+tables, so memory use does not depend on the file size. Overwritten bytes
+are kept in an overlay sorted by offset and written in place on save. */
+
+struct hexEdit {
+    long long offset;
+    unsigned char byte;
+};
+
+struct editorHex {
+    int active;
+    unsigned char *map; // the whole file, NULL when it is empty
+    long long size;
+    long long cursor; // byte offset
+    long long top; // offset of the first row on screen
+    int digits; // of the offset column
+    int nibble; // the low nibble of the cursor byte is typed next
+    int ascii; // typing goes to the character column
+    struct hexEdit *edits;
+    int nedits;
+    int editcap;
+} H;
+
+enum hexMark {
+    HEX_PLAIN = 0,
+    HEX_EDITED,
+    HEX_TWIN // the cursor byte in the column the cursor is not in
+};
+
+char *hexMarkCodes[] = {"\x1b[m", "\x1b[33m", "\x1b[7m"};
+char hexPairs[256][2]; // two hex digits of each byte
+char hexChars[256]; // what each byte shows as in the character column
+
+void editorHexTables() {
+    const char *digits = "0123456789abcdef";
+    for (int b = 0; b < 256; b++) {
+        hexPairs[b][0] = digits[b >> 4];
+        hexPairs[b][1] = digits[b & 15];
+        hexChars[b] = isprint(b) ? b : '.';
+    }
+}
+
+// index of the first edit at or after offset
+int editorHexFindEdit(long long offset) {
+    int lo = 0, hi = H.nedits;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (H.edits[mid].offset < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+unsigned char editorHexByte(long long offset) {
+    int e = editorHexFindEdit(offset);
+    return e < H.nedits && H.edits[e].offset == offset ? H.edits[e].byte : H.map[offset];
+}
+
+// overwrites the byte at offset, an edit back to the file's byte is dropped
+void editorHexSet(long long offset, unsigned char byte) {
+    int e = editorHexFindEdit(offset);
+    int found = e < H.nedits && H.edits[e].offset == offset;
+    if (byte == H.map[offset]) {
+        if (found) {
+            memmove(&H.edits[e], &H.edits[e + 1], sizeof(struct hexEdit) * (H.nedits - e - 1));
+            H.nedits--;
+        }
+        return;
+    }
+    if (!found) {
+        if (H.nedits == H.editcap) {
+            H.editcap = H.editcap ? H.editcap * 2 : 64;
+            H.edits = memRealloc(MEM_HEX, H.edits, sizeof(struct hexEdit) * H.editcap);
+        }
+        memmove(&H.edits[e + 1], &H.edits[e], sizeof(struct hexEdit) * (H.nedits - e));
+        H.nedits++;
+        H.edits[e].offset = offset;
+    }
+    H.edits[e].byte = byte;
+}
+
+int editorHexColumn(int b) {
+    return H.digits + 2 + b * 3 + (b >= HEX_ROW_BYTES / 2);
+}
+
+int editorHexCharColumn(int b) {
+    return H.digits + 4 + HEX_ROW_BYTES * 3 + b;
+}
+
+/* Formats the row at offset into line with a mark per char, returns its
+length. *e is the first edit not before offset, advanced past the row. */
+int editorHexFormatRow(long long offset, int *e, char *line, unsigned char *mark) {
+    int count = H.size - offset < HEX_ROW_BYTES ? H.size - offset : HEX_ROW_BYTES;
+    unsigned char bytes[HEX_ROW_BYTES], marks[HEX_ROW_BYTES];
+    memcpy(bytes, &H.map[offset], count);
+    memset(marks, HEX_PLAIN, sizeof(marks));
+    for (; *e < H.nedits && H.edits[*e].offset < offset + count; (*e)++) {
+        bytes[H.edits[*e].offset - offset] = H.edits[*e].byte;
+        marks[H.edits[*e].offset - offset] = HEX_EDITED;
+    }
+
+    int n = editorHexCharColumn(HEX_ROW_BYTES) + 1;
+    memset(line, ' ', n);
+    memset(mark, HEX_PLAIN, n);
+    for (int d = 0; d < H.digits; d++) {
+        line[d] = hexPairs[(offset >> (4 * (H.digits - 1 - d))) & 15][1];
+    }
+    line[editorHexCharColumn(0) - 1] = '|';
+    line[editorHexCharColumn(count)] = '|';
+    for (int b = 0; b < count; b++) {
+        int h = editorHexColumn(b), c = editorHexCharColumn(b);
+        memcpy(&line[h], hexPairs[bytes[b]], 2);
+        line[c] = hexChars[bytes[b]];
+        mark[h] = mark[h + 1] = mark[c] = marks[b];
+        if (offset + b == H.cursor) {
+            if (H.ascii) mark[h] = mark[h + 1] = HEX_TWIN;
+            else mark[c] = HEX_TWIN;
+        }
+    }
+    return n;
+}
+
+void editorHexDrawRows(struct AppendBuffer *ab) {
+    char line[editorHexCharColumn(HEX_ROW_BYTES) + 1];
+    unsigned char mark[sizeof(line)];
+    int e = editorHexFindEdit(H.top);
+    for (int i = 0; i < E.screenrows; i++) {
+        long long offset = H.top + (long long)i * HEX_ROW_BYTES;
+        if (offset >= H.size) {
+            abAppend(ab, "~", 1);
+        } else {
+            int n = editorHexFormatRow(offset, &e, line, mark);
+            if (n > E.screencols) n = E.screencols;
+            int current = HEX_PLAIN, from = 0;
+            for (int j = 0; j <= n; j++) {
+                if (j < n && mark[j] == current) continue;
+                abAppend(ab, &line[from], j - from);
+                if (j < n) {
+                    abAppend(ab, hexMarkCodes[HEX_PLAIN], 3);
+                    if (mark[j] != HEX_PLAIN) abAppend(ab, hexMarkCodes[mark[j]], strlen(hexMarkCodes[mark[j]]));
+                    current = mark[j];
+                }
+                from = j;
+            }
+            if (current != HEX_PLAIN) abAppend(ab, hexMarkCodes[HEX_PLAIN], 3);
         }
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
+    }
+}
+
+void editorHexScroll() {
+    long long row = H.cursor / HEX_ROW_BYTES;
+    if (H.cursor < H.top) H.top = row * HEX_ROW_BYTES;
+    if (row >= H.top / HEX_ROW_BYTES + E.screenrows) {
+        H.top = (row - E.screenrows + 1) * HEX_ROW_BYTES;
+    }
+    int b = H.cursor % HEX_ROW_BYTES;
+    E.screenCursorY = row - H.top / HEX_ROW_BYTES;
+    E.screenCursorX = H.ascii ? editorHexCharColumn(b) : editorHexColumn(b) + H.nibble;
+    if (E.screenCursorX >= E.screencols) E.screenCursorX = E.screencols - 1;
+}
+
+// returns 0 when file can't be mapped
+int editorHexOpen(char *file) {
+    editorCloseBuffer();
+    free(E.filename);
+    E.filename = strdup(file);
+    E.syntax = NULL;
+
+    int fd = open(file, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    H.map = NULL;
+    if (st.st_size > 0) {
+        H.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd); // the mapping stays
+    if (H.map == MAP_FAILED) {
+        H.map = NULL;
+        return 0;
+    }
+
+    editorHexTables();
+    H.active = 1;
+    H.size = st.st_size;
+    H.cursor = H.top = 0;
+    H.nibble = H.ascii = 0;
+    H.digits = 8;
+    while (H.digits < 16 && (H.size - 1) >> (4 * H.digits)) H.digits++;
+    return 1;
+}
+
+void editorHexClose() {
+    if (!H.active) return;
+    if (H.map) munmap(H.map, H.size);
+    memFree(MEM_HEX, H.edits);
+    memset(&H, 0, sizeof(H));
+}
+
+// a NUL byte in the first block marks a binary file
+int editorIsBinary(char *file) {
+    char buf[4096];
+    int fd = open(file, O_RDONLY);
+    if (fd == -1) return 0;
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+// writes the overlay in place, the file size never changes
+void editorHexSave() {
+    int fd = open(E.filename, O_WRONLY);
+    if (fd != -1) {
+        int i, j;
+        for (i = 0; i < H.nedits; i = j) { // one write per run of adjacent bytes
+            unsigned char run[4096];
+            int n = 0;
+            for (j = i; j < H.nedits && n < (int)sizeof(run) && H.edits[j].offset == H.edits[i].offset + n; j++) {
+                run[n++] = H.edits[j].byte;
+            }
+            if (pwrite(fd, run, n, H.edits[i].offset) != n) break;
+        }
+        close(fd);
+        if (i >= H.nedits) {
+            editorSetStatusMessage("%d bytes written to disk", H.nedits);
+            H.nedits = 0; // the mapping shows them now
+            E.dirty = 0;
+            return;
+        }
+    }
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+}
+
+void editorHexGoto() {
+    char *query = editorPrompt("Goto offset: %s (0x for hex, ESC to cancel)", NULL);
+    if (query == NULL) return;
+    char *end;
+    long long offset = strtoll(query, &end, 0);
+    if (*end || offset < 0 || offset >= H.size) {
+        editorSetStatusMessage("No offset %s in %lld bytes", query, H.size);
+    } else {
+        H.cursor = offset;
+        H.nibble = 0;
+    }
+    free(query);
+}
+
+void editorHexMove(long long delta) {
+    long long to = H.cursor + delta;
+    if (to < 0) to = delta < -1 ? H.cursor % HEX_ROW_BYTES : 0;
+    if (to >= H.size) to = H.size > 0 ? H.size - 1 : 0;
+    H.cursor = to;
+    H.nibble = 0;
+}
+
+// handles c in the hex view, returns 0 for keys handled as usual
+int editorHexKey(int c) {
+    long long page = (long long)HEX_ROW_BYTES * E.screenrows;
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('t'):
+            return 0;
+        case ARROW_LEFT:
+            editorHexMove(-1);
+            break;
+        case ARROW_RIGHT:
+            editorHexMove(1);
+            break;
+        case ARROW_UP:
+            editorHexMove(-HEX_ROW_BYTES);
+            break;
+        case ARROW_DOWN:
+            editorHexMove(HEX_ROW_BYTES);
+            break;
+        case PAGE_UP:
+            editorHexMove(-page);
+            break;
+        case PAGE_DOWN:
+            editorHexMove(page);
+            break;
+        case HOME_KEY:
+            editorHexMove(-(H.cursor % HEX_ROW_BYTES));
+            break;
+        case END_KEY:
+            editorHexMove(HEX_ROW_BYTES - 1 - H.cursor % HEX_ROW_BYTES);
+            break;
+        case '\t':
+            H.ascii = !H.ascii;
+            H.nibble = 0;
+            break;
+        case CTRL_KEY('s'):
+            editorHexSave();
+            break;
+        case CTRL_KEY('g'):
+            editorHexGoto();
+            break;
+        case BACKSPACE:
+        case CTRL_KEY('h'):
+        case DEL_KEY: // restore the file's byte
+            if (c != DEL_KEY) editorHexMove(-1);
+            if (H.size) editorHexSet(H.cursor, H.map[H.cursor]);
+            break;
+        default:
+            if (H.size == 0 || c >= 128 || iscntrl(c)) break;
+            if (H.ascii) {
+                editorHexSet(H.cursor, c);
+                editorHexMove(1);
+            } else if (isxdigit(c)) {
+                int v = isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+                unsigned char b = editorHexByte(H.cursor);
+                b = H.nibble ? (b & 0xf0) | v : (b & 0x0f) | (v << 4);
+                editorHexSet(H.cursor, b);
+                if (H.nibble) {
+                    editorHexMove(1);
+                } else {
+                    H.nibble = 1;
+                }
+            }
+    }
+    E.dirty = H.nedits;
+    return 1;
+}
+
+/*** file I/O ***/
+
+void editorOpen(char * file) {
+    if (editorIsBinary(file) && editorHexOpen(file)) return;
+    editorCloseBuffer();
+    free(E.filename);
+    E.filename = strdup(file);
+
+    editorSelectSyntaxHighlight();
+    if (editorOpenCached()) {
+        E.dirty = 0;
+        editorWatchFile();
+        return;
+    }
+
+    FILE *fp = fopen(file, "r");
+    if (!fp) {
+        die("fopen");
+    }
+
+    // bytes each row took in the file, kept for the open cache
+    struct stat st;
+    char dir[PATH_MAX];
+    int known = fstat(fileno(fp), &st) == 0;
+    int caching = known && editorCacheDir(dir, sizeof(dir));
+    int *filelen = NULL, filelencap = 0;
+    long long total = 0, offset = 0;
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        if (caching) {
+            if (E.numrows == filelencap) {
+                filelencap = filelencap ? filelencap * 2 : 1024;
+                filelen = realloc(filelen, sizeof(int) * filelencap);
+            }
+            filelen[E.numrows] = linelen;
+            total += linelen;
+        }
+        ssize_t filebytes = linelen;
+        while (linelen > 0 && (line[linelen-1] == '\n' || line[linelen - 1] == '\r')) {
+            linelen--;
+        }
+
+        editorInsertRow(E.numrows, line, linelen);
+        if (filebytes - linelen == 1 && line[linelen] == '\n') { // saved back as it was
+            E.erow[E.numrows - 1].origin = offset;
+        }
+        offset += filebytes;
+    }
+
+    free(line);
+    fclose(fp);
+    if (caching && total == st.st_size) editorCacheSave(&st, filelen);
+    if (known) E.origin = st;
+    free(filelen);
+    E.dirty = 0; // when file is opened, there are no unsaved changes.
+    editorWatchFile();
+}
+
+// true while the rows' origins still describe the file with stat st
+int editorOriginValid(struct stat *st) {
+    return E.origin.st_ino != 0 && st->st_dev == E.origin.st_dev && st->st_ino == E.origin.st_ino &&
+        st->st_size == E.origin.st_size && st->st_mtim.tv_sec == E.origin.st_mtim.tv_sec &&
+        st->st_mtim.tv_nsec == E.origin.st_mtim.tv_nsec;
+}
+
+// writes all of buf to fd, returns 0 on error
+int editorWriteAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return 0;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+
+struct saveOut {
+    int fd;
+    int src; // the file the rows were loaded from, -1 when their origins can't be used
+    char *buf;
+    int used;
+    long long copied;
+};
+
+// appends a row and its '\n' to the chunk, writing the chunk out when full
+int editorSaveRow(struct saveOut *out, editorrow *row) {
+    if (out->used + row->length + 1 > SAVE_CHUNK) {
+        if (!editorWriteAll(out->fd, out->buf, out->used)) return 0;
+        out->used = 0;
+        if (row->length + 1 > SAVE_CHUNK) {
+            return editorWriteAll(out->fd, row->text, row->length) && editorWriteAll(out->fd, "\n", 1);
+        }
+    }
+    memcpy(out->buf + out->used, row->text, row->length);
+    out->buf[out->used + row->length] = '\n';
+    out->used += row->length + 1;
+    return 1;
+}
+
+// writes rows [from, to), which are len contiguous bytes of out->src
+int editorSaveRun(struct saveOut *out, int from, int to, long long len) {
+    if (len < SAVE_MIN_COPY) {
+        for (int j = from; j < to; j++) {
+            if (!editorSaveRow(out, &E.erow[j])) return 0;
+        }
+        return 1;
+    }
+    if (!editorWriteAll(out->fd, out->buf, out->used)) return 0;
+    out->used = 0;
+    loff_t off = E.erow[from].origin;
+    while (len > 0) {
+        ssize_t n = copy_file_range(out->src, &off, out->fd, NULL, len, 0);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        len -= n;
+        out->copied += n;
+    }
+    return 1;
+}
+
+/* Writes the rows to fd from its current offset, returns the bytes written
+or -1 on error. Runs of rows still at their origin in src are copied file
+to file with copy_file_range: on file systems with reflinks the extents
+are shared, elsewhere the copy at least stays in the kernel. The other
+rows go out through a SAVE_CHUNK buffer. */
+long long editorWriteRows(int fd, int src, long long *copied) {
+    struct saveOut out = { fd, src, memAlloc(MEM_APPEND_BUFFER, SAVE_CHUNK), 0, 0 };
+    long long total = 0, runLen = 0;
+    int run = 0, ok = 1; // rows [run, j) are a run of runLen bytes at their origin
+
+    for (int j = 0; ok && j < E.numrows; j++) {
+        editorrow *row = &E.erow[j];
+        total += row->length + 1;
+        if (runLen && row->origin == E.erow[run].origin + runLen) {
+            runLen += row->length + 1;
+            continue;
+        }
+        ok = editorSaveRun(&out, run, j, runLen);
+        run = j;
+        runLen = 0;
+        if (src != -1 && row->origin != -1) {
+            runLen = row->length + 1;
+        } else {
+            ok = ok && editorSaveRow(&out, row);
+            run = j + 1;
+        }
+    }
+    ok = ok && editorSaveRun(&out, run, E.numrows, runLen) && editorWriteAll(fd, out.buf, out.used);
+
+    memFree(MEM_APPEND_BUFFER, out.buf);
+    *copied = out.copied;
+    return ok ? total : -1;
+}
+
+/* Writes the rows to a temp file next to path, then renames it over path,
+so the file on disk is always either the old or the new version. Rows path
+still holds unchanged are copied from it rather than written. Returns the
+bytes written, -1 on error with errno set. */
+long long editorSaveReplace(char *path, struct stat *old, int exists, struct stat *st, long long *copied) {
+    char *tmp = NULL;
+    long long len = -1;
+    int fd = asprintf(&tmp, "%s.lite-XXXXXX", path) == -1 ? -1 : mkstemp(tmp);
+    if (fd != -1) {
+        mode_t mask = umask(0);
+        umask(mask);
+        if (exists) {
+            if (fchown(fd, old->st_uid, old->st_gid) == -1) {} // only root can give files away
+            fchmod(fd, old->st_mode & 07777);
+        } else {
+            fchmod(fd, 0644 & ~mask);
+        }
+
+        int src = exists && editorOriginValid(old) ? open(path, O_RDONLY) : -1;
+        len = editorWriteRows(fd, src, copied);
+        if (len == -1 && src != -1) { // no copying between these files, write it all
+            *copied = 0;
+            if (ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0) len = editorWriteRows(fd, -1, copied);
+        }
+        if (src != -1) close(src);
+        if (len != -1 && (fsync(fd) == -1 || fstat(fd, st) == -1 || rename(tmp, path) == -1)) len = -1;
+
+        int err = errno;
+        close(fd);
+        if (len == -1) unlink(tmp);
+        errno = err;
+    }
+    free(tmp);
+    return len;
+}
+
+/* Rewrites path in place, for when a temp file can't be made next to it or
+renaming one over it would split its hard links. Not atomic: a crash can
+leave the file half written. */
+long long editorSaveInPlace(char *path, struct stat *st) {
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) return -1;
+    long long copied, len = editorWriteRows(fd, -1, &copied);
+    if (len != -1 && (ftruncate(fd, len) == -1 || fsync(fd) == -1 || fstat(fd, st) == -1)) len = -1;
+    int err = errno;
+    close(fd);
+    errno = err;
+    return len;
+}
+
+void editorSave() {
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    } else if (E.diskChanged) {
+        char *answer = editorPrompt("File changed on disk. Overwrite? (y/n): %s", NULL);
+        int overwrite = answer && (answer[0] == 'y' || answer[0] == 'Y');
+        free(answer);
+        if (!overwrite) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+    }
+
+    char *path = realpath(E.filename, NULL);
+    if (path == NULL) path = strdup(E.filename); // a new file
+    struct stat old, st;
+    int exists = stat(path, &old) == 0;
+    long long len = -1, copied = 0;
+    if (!exists || old.st_nlink == 1) {
+        len = editorSaveReplace(path, &old, exists, &st, &copied);
+    }
+    if ((exists && old.st_nlink > 1) || (len == -1 && (errno == EACCES || errno == EROFS))) {
+        len = editorSaveInPlace(path, &st);
+    }
+    free(path);
+    if (len == -1) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+        return;
+    }
+
+    long long off = 0;
+    for (int j = 0; j < E.numrows; j++) {
+        E.erow[j].origin = off;
+        off += E.erow[j].length + 1;
+    }
+    E.origin = st;
+    editorCacheSave(&st, NULL);
+    editorSetStatusMessage("%lld bytes written to disk (%lld copied)", len, copied);
+    E.dirty = 0; // changes saved successfully
+    editorWatchDrain(); // our own write is not an external change
+    editorWatchFile();
+}
+
+/*** open cache ***/
+
+/* Large files get a cache entry in ~/.cache/lite (or $XDG_CACHE_HOME/lite),
+used only when that directory exists. It holds the length of each row and
+its line terminator as varints, and the hl_open_comment state at the end
+of every CACHE_CHECKPOINT-th row as a bitset, for a file identified by its
+path, device, inode, size and mtime. Reopening an unchanged file then cuts
+the rows straight out of a mapping of it and leaves them lazy: only the
+rows that get drawn are rendered and highlighted, starting from the
+closest checkpoint above. */
+
+#define CACHE_MAGIC "liteidx1"
+#define CACHE_MIN_ROWS 4096 // smaller files load fast enough
+#define CACHE_CHECKPOINT 256
+
+struct cacheHeader {
+    char magic[8];
+    long long dev, ino, size, mtime, mtimeNsec;
+    int syntax; // HLDB entry the checkpoints were computed with, -1 for none
+    int rows;
+    int pathlen;
+};
+
+// fills dir with the cache directory, returns 0 when it does not exist
+int editorCacheDir(char *dir, size_t size) {
+    char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (xdg && *xdg) {
+        snprintf(dir, size, "%s/lite", xdg);
+    } else if (home && *home) {
+        snprintf(dir, size, "%s/.cache/lite", home);
+    } else {
+        return 0;
+    }
+    struct stat st;
+    return stat(dir, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// the cache file for path, NULL when caching is off or path can't be resolved
+char *editorCachePath(const char *path) {
+    char dir[PATH_MAX], *full, *name;
+    if (!editorCacheDir(dir, sizeof(dir))) return NULL;
+    if ((full = realpath(path, NULL)) == NULL) return NULL;
+    if (asprintf(&name, "%s/%016llx.idx", dir, editorHashLine(full, strlen(full))) == -1) name = NULL;
+    free(full);
+    return name;
+}
+
+void editorCacheHeader(struct cacheHeader *h, struct stat *st, char *full) {
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+    h->dev = st->st_dev;
+    h->ino = st->st_ino;
+    h->size = st->st_size;
+    h->mtime = st->st_mtim.tv_sec;
+    h->mtimeNsec = st->st_mtim.tv_nsec;
+    h->syntax = E.syntax ? E.syntax - HLDB : -1;
+    h->rows = E.numrows;
+    h->pathlen = strlen(full);
+}
+
+void cachePutVarint(FILE *fp, unsigned long long v) {
+    while (v >= 0x80) {
+        putc((v & 0x7f) | 0x80, fp);
+        v >>= 7;
+    }
+    putc(v, fp);
+}
+
+int cacheGetVarint(unsigned char **p, unsigned char *end, unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char c = *(*p)++;
+        *v |= (unsigned long long)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 1;
+    }
+    return 0;
+}
+
+/* Writes the cache for the rows just loaded from or saved to a file with
+stat st. filelen holds the bytes each row took in the file, NULL when every
+row was followed by a single '\n'. Written to a temp file then renamed, so
+a reader never sees half of it. */
+void editorCacheSave(struct stat *st, int *filelen) {
+    if (E.numrows < CACHE_MIN_ROWS) return;
+    for (int j = CACHE_CHECKPOINT - 1; j < E.numrows; j += CACHE_CHECKPOINT) {
+        if (E.erow[j].hl_open_comment == -1) return; // not known, nothing to save
+    }
+
+    char *path = editorCachePath(E.filename), *full = realpath(E.filename, NULL), *tmp = NULL;
+    if (path == NULL || full == NULL || asprintf(&tmp, "%s.%d", path, (int)getpid()) == -1) {
+        free(path);
+        free(full);
+        return;
+    }
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp) {
+        struct cacheHeader h;
+        editorCacheHeader(&h, st, full);
+        fwrite(&h, sizeof(h), 1, fp);
+        fwrite(full, 1, h.pathlen, fp);
+        for (int j = 0; j < E.numrows; j++) {
+            cachePutVarint(fp, E.erow[j].length);
+            cachePutVarint(fp, filelen ? filelen[j] - E.erow[j].length : 1);
+        }
+        unsigned char bits = 0;
+        int nbits = 0;
+        for (int j = CACHE_CHECKPOINT - 1; j < E.numrows; j += CACHE_CHECKPOINT) {
+            bits |= (E.erow[j].hl_open_comment ? 1 : 0) << nbits;
+            if (++nbits == 8) {
+                putc(bits, fp);
+                bits = nbits = 0;
+            }
+        }
+        if (nbits) putc(bits, fp);
+
+        if (fclose(fp) == 0 && rename(tmp, path) == 0) {
+            tmp[0] = '\0';
+        }
+    }
+    if (tmp[0]) unlink(tmp);
+    free(tmp);
+    free(path);
+    free(full);
+}
+
+// reads the whole cache file for E.filename, NULL if there is none
+unsigned char *editorCacheRead(size_t *len) {
+    char *path = editorCachePath(E.filename);
+    if (path == NULL) return NULL;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) return NULL;
+
+    struct stat st;
+    unsigned char *data = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct cacheHeader)) {
+        data = malloc(st.st_size);
+        if (data && read(fd, data, st.st_size) != st.st_size) {
+            free(data);
+            data = NULL;
+        }
+        *len = st.st_size;
+    }
+    close(fd);
+    return data;
+}
+
+// builds lazy rows from the cache entry in data for the file open as fd
+int editorCacheLoad(unsigned char *data, size_t len, int fd, struct stat *st, char *full) {
+    struct cacheHeader h;
+    editorCacheHeader(&h, st, full);
+    h.rows = ((struct cacheHeader *)data)->rows;
+    if (memcmp(&h, data, sizeof(h)) || len < sizeof(h) + h.pathlen ||
+        memcmp(data + sizeof(h), full, h.pathlen)) return 0;
+
+    char *map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) return 0;
+
+    unsigned char *p = data + sizeof(h) + h.pathlen, *end = data + len;
+    editorReserveRows(h.rows);
+    long long off = 0;
+    for (int j = 0; j < h.rows; j++) {
+        unsigned long long textlen, termlen;
+        if (!cacheGetVarint(&p, end, &textlen) || !cacheGetVarint(&p, end, &termlen) ||
+            off + (long long)(textlen + termlen) > st->st_size) break;
+
+        editorrow *row = &E.erow[j];
+        memset(row, 0, sizeof(*row));
+        row->idx = j;
+        row->length = textlen;
+        row->text = poolAlloc(&E.pool, textlen + 1, &row->capacity);
+        memcpy(row->text, &map[off], textlen);
+        row->text[textlen] = '\0';
+        row->hl_open_comment = -1;
+        row->symbols = E.syntax ? -1 : 0;
+        row->lazy = 1;
+        row->origin = termlen == 1 && map[off + textlen] == '\n' ? off : -1;
+        off += textlen + termlen;
+        E.numrows++;
+    }
+    munmap(map, st->st_size);
+
+    int nbits = h.rows / CACHE_CHECKPOINT;
+    if (E.numrows != h.rows || off != st->st_size || end - p != (nbits + 7) / 8) {
+        editorCloseBuffer(); // stale or damaged entry
+        return 0;
+    }
+    for (int b = 0; b < nbits; b++) {
+        E.erow[(b + 1) * CACHE_CHECKPOINT - 1].hl_open_comment = (p[b / 8] >> (b % 8)) & 1;
+    }
+    if (E.syntax) editorSymbolsAllStale();
+    E.lines.stale = 1;
+    E.vlines.stale = 1;
+    return 1;
+}
+
+/* Loads E.filename through its cache entry, returns 0 with an empty buffer
+when there is no entry matching the file as it is now. */
+int editorOpenCached() {
+    if (E.softWrap) return 0; // every row would have to be wrapped anyway
+
+    size_t len;
+    unsigned char *data = editorCacheRead(&len);
+    if (data == NULL) return 0;
+
+    int ok = 0;
+    struct stat st;
+    char *full = realpath(E.filename, NULL);
+    int fd = open(E.filename, O_RDONLY);
+    if (fd != -1 && full && fstat(fd, &st) == 0 && st.st_size > 0) {
+        ok = editorCacheLoad(data, len, fd, &st, full);
+    }
+    if (ok) E.origin = st;
+    if (fd != -1) close(fd);
+    free(full);
+    free(data);
+    return ok;
+}
+
+/*** file watch ***/
+
+/* The directory of the open file is watched with inotify, so that both in
+place writes and atomic replaces (write to a temp file, then rename) are
+seen. A clean buffer is reloaded by diffing line hashes against the rows
+and replacing only the hunks that differ; a modified buffer is left alone
+and the next save asks before overwriting. */
+
+#define WATCH_MAX_EDITS 500 // larger diffs replace the whole changed middle
+
+struct diskLine {
+    char *s;
+    int len;
+    unsigned long long hash;
+};
+
+struct diffHunk {
+    int a0, a1; // rows [a0, a1) of the buffer
+    int b0, b1; // are replaced by lines [b0, b1) of the file
+};
+
+unsigned long long editorHashLine(const char *s, int len) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void editorWatchFile() {
+    if (E.watchfd == -1) {
+        E.watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E.watchfd == -1) return; // no inotify, run without watching
+    }
+    if (E.watchwd != -1) {
+        inotify_rm_watch(E.watchfd, E.watchwd);
+        E.watchwd = -1;
+    }
+    if (E.filename == NULL) return;
+
+    char *slash = strrchr(E.filename, '/');
+    char *dir = slash ? strndup(E.filename, slash == E.filename ? 1 : slash - E.filename) : strdup(".");
+    E.watchwd = inotify_add_watch(E.watchfd, dir,
+        IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_MOVED_FROM);
+    free(dir);
+    E.diskChanged = 0;
+}
+
+// consumes pending inotify events, returns 1 if any of them is about the open file
+int editorWatchDrain() {
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const char *slash = E.filename ? strrchr(E.filename, '/') : NULL;
+    const char *base = slash ? slash + 1 : E.filename;
+    int hit = 0;
+    ssize_t len;
+
+    if (E.watchfd == -1) return 0;
+    while ((len = read(E.watchfd, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (p < buf + len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (base && ev->wd == E.watchwd && ev->len && !strcmp(ev->name, base)) {
+                hit = 1;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return hit;
+}
+
+int editorLinesEqual(struct diskLine *a, struct diskLine *b) {
+    return a->hash == b->hash && a->len == b->len && !memcmp(a->s, b->s, a->len);
+}
+
+/* Myers' O(ND) diff of old[0, n) against new[0, m), appending hunks to *hunks
+from the bottom of the file up, which is the order they can be applied in
+without shifting the ones still pending. Returns -1 when the edit distance
+exceeds WATCH_MAX_EDITS. */
+int editorDiffLines(struct diskLine *old, int n, struct diskLine *new, int m,
+                    struct diffHunk **hunks, int *nhunks) {
+    int max = n + m;
+    if (max > WATCH_MAX_EDITS) max = WATCH_MAX_EDITS;
+    int *v = malloc(sizeof(int) * (2 * max + 2));
+    int **trace = malloc(sizeof(int *) * (max + 1));
+    int d, ntrace, found = -1;
+
+    v[max + 1] = 0;
+    for (d = 0; d <= max && found == -1; d++) {
+        trace[d] = malloc(sizeof(int) * (2 * max + 2));
+        memcpy(trace[d], v, sizeof(int) * (2 * max + 2));
+        for (int k = -d; k <= d; k += 2) {
+            int x;
+            if (k == -d || (k != d && v[max + k - 1] < v[max + k + 1])) {
+                x = v[max + k + 1];
+            } else {
+                x = v[max + k - 1] + 1;
+            }
+            int y = x - k;
+            while (x < n && y < m && editorLinesEqual(&old[x], &new[y])) {
+                x++;
+                y++;
+            }
+            v[max + k] = x;
+            if (x >= n && y >= m) {
+                found = d;
+                break;
+            }
+        }
+    }
+
+    ntrace = d;
+
+    if (found != -1) {
+        int x = n, y = m;
+        struct diffHunk cur = { -1, -1, -1, -1 };
+        for (d = found; d > 0; d--) {
+            int *pv = trace[d]; // the furthest points reached with d - 1 edits
+            int k = x - y;
+            int prev_k = (k == -d || (k != d && pv[max + k - 1] < pv[max + k + 1])) ? k + 1 : k - 1;
+            int prev_x = pv[max + prev_k];
+            int prev_y = prev_x - prev_k;
+            int mid_x = prev_k == k + 1 ? prev_x : prev_x + 1; // after the one edit
+            int mid_y = mid_x - k;
+
+            if (x > mid_x && cur.a0 != -1) { // equal lines end the pending hunk
+                *hunks = realloc(*hunks, sizeof(struct diffHunk) * (*nhunks + 1));
+                (*hunks)[(*nhunks)++] = cur;
+                cur.a0 = -1;
+            }
+            if (cur.a0 == -1) {
+                cur.a1 = mid_x;
+                cur.b1 = mid_y;
+            }
+            cur.a0 = prev_x;
+            cur.b0 = prev_y;
+            x = prev_x;
+            y = prev_y;
+        }
+        if (cur.a0 != -1) {
+            *hunks = realloc(*hunks, sizeof(struct diffHunk) * (*nhunks + 1));
+            (*hunks)[(*nhunks)++] = cur;
+        }
+    }
+
+    for (int i = 0; i < ntrace; i++) free(trace[i]);
+    free(trace);
+    free(v);
+    return found == -1 ? -1 : 0;
+}
+
+/* Reads path split into lines as editorOpen does, returns the buffer backing
+them. st is the stat of what was read, with st_ino 0 if it was cut short. */
+char* editorReadDiskLines(const char *path, struct diskLine **lines, int *nlines, struct stat *st) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) return NULL;
+
+    if (fstat(fd, st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    char *data = malloc(st->st_size + 1);
+    ssize_t total = 0, nread;
+    while (total < st->st_size && (nread = read(fd, data + total, st->st_size - total)) > 0) {
+        total += nread;
+    }
+    close(fd);
+    if (total != st->st_size) st->st_ino = 0;
+    data[total] = '\0';
+
+    int cap = 64, count = 0;
+    *lines = malloc(sizeof(struct diskLine) * cap);
+    char *p = data, *end = data + total;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        int len = nl ? nl - p : end - p;
+        while (len > 0 && (p[len - 1] == '\r' || p[len - 1] == '\n')) len--;
+        if (count == cap) {
+            cap *= 2;
+            *lines = realloc(*lines, sizeof(struct diskLine) * cap);
+        }
+        (*lines)[count].s = p;
+        (*lines)[count].len = len;
+        (*lines)[count].hash = editorHashLine(p, len);
+        count++;
+        p = nl ? nl + 1 : end;
+    }
+    *nlines = count;
+    return data;
+}
+
+void editorReloadFromDisk() {
+    struct diskLine *new = NULL;
+    struct stat st;
+    int m;
+    char *data = editorReadDiskLines(E.filename, &new, &m, &st);
+    if (data == NULL) {
+        editorSetStatusMessage("File changed on disk but can't be read: %s", strerror(errno));
+        return;
+    }
+
+    int n = E.numrows;
+    struct diskLine *old = malloc(sizeof(struct diskLine) * (n ? n : 1));
+    for (int i = 0; i < n; i++) {
+        old[i].s = E.erow[i].text;
+        old[i].len = E.erow[i].length;
+        old[i].hash = editorHashLine(old[i].s, old[i].len);
+    }
+
+    int p = 0, q = 0;
+    while (p < n && p < m && editorLinesEqual(&old[p], &new[p])) p++;
+    while (q < n - p && q < m - p && editorLinesEqual(&old[n - 1 - q], &new[m - 1 - q])) q++;
+
+    struct diffHunk *hunks = NULL;
+    int nhunks = 0;
+    if (editorDiffLines(&old[p], n - p - q, &new[p], m - p - q, &hunks, &nhunks) == -1) {
+        nhunks = 0;
+        hunks = realloc(hunks, sizeof(struct diffHunk));
+        hunks[nhunks++] = (struct diffHunk) { 0, n - p - q, 0, m - p - q };
+    }
+    free(old);
+
+    int changed = 0;
+    for (int h = 0; h < nhunks; h++) { // bottom up, rows above keep their index
+        struct diffHunk *hk = &hunks[h];
+        int a0 = hk->a0 + p, b0 = hk->b0 + p;
+        int na = hk->a1 - hk->a0, nb = hk->b1 - hk->b0;
+        int same = na < nb ? na : nb;
+
+        if (na > nb) editorDelRows(a0 + same, na - nb);
+        if (nb > na) editorInsertRows(a0 + same, nb - na);
+        for (int i = nb - 1; i >= 0; i--) {
+            editorRowSetText(&E.erow[a0 + i], new[b0 + i].s, new[b0 + i].len);
+        }
+        changed += na > nb ? na : nb;
+    }
+    for (int h = nhunks - 1; h >= 0; h--) { // top down, carry comment state past each hunk
+        int after = hunks[h].b1 + p;
+        if (after < E.numrows) editorUpdateSyntax(&E.erow[after]);
+    }
+    for (int i = 0; i < m; i++) { // rows now match the lines just read
+        int kept = new[i].s[new[i].len] == '\n';
+        E.erow[i].origin = kept ? new[i].s - data : -1;
+    }
+    E.origin = st;
+    free(hunks);
+    free(new);
+    free(data);
+
+    if (E.cursorY > E.numrows) E.cursorY = E.numrows;
+    if (E.cursorY < E.numrows && E.cursorX > E.erow[E.cursorY].length) {
+        E.cursorX = E.erow[E.cursorY].length;
+    }
+    E.dirty = 0;
+    editorSetStatusMessage("Reloaded from disk: %d row(s) changed", changed);
+}
+
+// a change seen while a prompt was open, handled once it is closed
+int editorWatchPending() {
+    return !E.inPrompt && E.diskChanged == 1;
+}
+
+// handles pending watch events, returns 1 when the buffer was reloaded
+int editorWatchService() {
+    if (E.followfd != -1) { // read from the wait loop, one slice at a time
+        if (editorWatchDrain()) E.followPending = 1;
+        return 0;
+    }
+
+    if (editorWatchDrain() && E.diskChanged == 0) E.diskChanged = 1;
+    if (E.diskChanged != 1 || E.inPrompt) return 0;
+
+    if (E.dirty) {
+        E.diskChanged = 2; // conflict: keep the buffer, warn again on save
+        editorSetStatusMessage("WARNING! File changed on disk, saving will overwrite it");
+        return 1;
+    }
+    editorReloadFromDisk();
+    E.diskChanged = 0;
+    return 1;
+}
+
+/*** streaming ***/
+
+/* Rows can be fed incrementally from a pipe ("lite -") or from the end of a
+growing file in follow mode ("lite -f file"). Each ingest call reads for at
+most STREAM_SLICE_MS so keys keep being handled while data arrives; only the
+appended rows are highlighted, and the view follows the end of the buffer
+when the cursor is on the last row. */
+
+#define STREAM_CHUNK 65536
+#define STREAM_SLICE_MS 15
+
+// adds a streamed line, without its "\n" or "\r\n", as the last row
+void editorStreamLine(char *s, int len) {
+    if (len > 0 && s[len - 1] == '\r') len--;
+    editorInsertRow(E.numrows, s, len);
+}
+
+// appends data to the buffer, keeping an unfinished last line for the next read
+void editorStreamAppend(char *data, int len) {
+    char *p = data, *end = data + len;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        int piece = nl ? nl - p : end - p;
+        if (nl == NULL || E.streamLineLen) {
+            if (E.streamLineLen + piece > E.streamLineCap) {
+                E.streamLineCap = (E.streamLineLen + piece) * 2;
+                E.streamLine = memRealloc(MEM_ROW_TEXT, E.streamLine, E.streamLineCap);
+            }
+            memcpy(E.streamLine + E.streamLineLen, p, piece);
+            E.streamLineLen += piece;
+            if (nl == NULL) break;
+            editorStreamLine(E.streamLine, E.streamLineLen);
+            E.streamLineLen = 0;
+        } else {
+            editorStreamLine(p, piece);
+        }
+        p = nl + 1;
+    }
+}
+
+// reads what fd has to offer within a time slice, returns 0 at end of file
+int editorStreamRead(int fd) {
+    static char buf[STREAM_CHUNK];
+    double start = editorNow();
+    int atEnd = E.cursorY >= E.numrows - 1;
+    int dirty = E.dirty; // streamed rows are content, not edits
+    int more = 1;
+
+    while (editorNow() - start < STREAM_SLICE_MS / 1000.0) {
+        ssize_t nread = read(fd, buf, sizeof(buf));
+        if (nread == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) more = 0;
+            break;
+        }
+        if (nread == 0) {
+            more = 0;
+            break;
+        }
+        editorStreamAppend(buf, nread);
+        E.streamBytes += nread;
+    }
+    E.streamTime += editorNow() - start;
+    E.dirty = dirty;
+
+    if (atEnd && E.numrows > 0) {
+        E.cursorY = E.numrows - 1;
+        E.cursorX = 0;
+    }
+    editorSetStatusMessage("%s: %.1f MB %s at %.1f MB/s", E.streamName,
+        E.streamBytes / 1e6, more ? "read" : "loaded",
+        E.streamTime > 0 ? E.streamBytes / 1e6 / E.streamTime : 0.0);
+    return more;
+}
+
+void editorStreamService() {
+    editorScreenReset(); // the command feeding the pipe may write to the terminal too
+    if (!editorStreamRead(E.streamfd)) {
+        if (E.streamLineLen) { // the stream ended without a last '\n'
+            int dirty = E.dirty;
+            editorStreamLine(E.streamLine, E.streamLineLen);
+            E.streamLineLen = 0;
+            E.dirty = dirty;
+        }
+        close(E.streamfd);
+        E.streamfd = -1;
+    }
+}
+
+// moves the piped stdin to a new descriptor and puts the terminal on stdin
+int editorStdinToTerminal() {
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1) die("open /dev/tty");
+    if (dup2(tty, STDIN_FILENO) == -1) die("dup2");
+    close(tty);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+void editorOpenStream(int fd) {
+    E.streamfd = fd;
+    E.streamName = "stdin";
+}
+
+// appended data seen by the watch, read once no prompt is open
+int editorFollowPending() {
+    return E.followfd != -1 && E.followPending && !E.inPrompt;
+}
+
+// reads one slice of the rows added to the followed file since the last read
+void editorFollowService() {
+    struct stat st, cur;
+    E.followPending = 0;
+    if (fstat(E.followfd, &st) == -1) return;
+
+    int replaced = stat(E.filename, &cur) == 0 && cur.st_ino != st.st_ino;
+    if (replaced || st.st_size < lseek(E.followfd, 0, SEEK_CUR)) {
+        if (E.dirty) { // conflict: keep the edited rows, append nothing
+            if (E.diskChanged != 2) {
+                E.diskChanged = 2;
+                editorSetStatusMessage("WARNING! %s was rotated or truncated, saving will overwrite it", E.filename);
+            }
+            return;
+        }
+        // rotated or truncated: start over from the new file
+        int fd = open(E.filename, O_RDONLY);
+        if (fd == -1) return;
+        close(E.followfd);
+        E.followfd = fd;
+        editorCloseBuffer();
+        editorScreenReset();
+        E.streamLineLen = 0;
+        E.diskChanged = 0;
+    }
+    E.followPending = editorStreamRead(E.followfd);
+}
+
+void editorFollow(char *file) {
+    free(E.filename);
+    E.filename = strdup(file);
+    editorSelectSyntaxHighlight();
+
+    E.followfd = open(file, O_RDONLY);
+    if (E.followfd == -1) die("open");
+    E.streamName = E.filename;
+    E.followPending = 1; // the file so far is read in slices like appended data
+    editorWatchFile();
+}
+
+/*** filter ***/
+
+/* Ctrl-U pipes the selected rows, or the cursor row, through a shell command
+and replaces them with its output, like vim's "!". The rows are written to
+the command with writev straight from their text while its output is read
+in the same poll loop, so a large range never deadlocks on a full pipe.
+Output lines become lazy rows as they arrive and go in with one attach and
+one highlighting pass over the new range. */
+
+#define FILTER_IOV 512 // iovecs handed to one writev, two per row
+#define FILTER_ERR 60 // bytes of the command's stderr kept for the status line
+
+struct filterOut {
+    editorrow *rows;
+    int nrows;
+    int capacity;
+    char *partial; // a line split across reads
+    int plen;
+    int pcap;
+    char err[FILTER_ERR + 1];
+    int errlen;
+};
+
+// adds an output line, without its "\n" or "\r\n", as a lazy row
+void editorFilterLine(struct filterOut *out, char *s, int len) {
+    if (len > 0 && s[len - 1] == '\r') len--;
+    if (out->nrows == out->capacity) {
+        out->capacity = out->capacity ? out->capacity * 2 : 1024;
+        out->rows = memRealloc(MEM_FILTER, out->rows, sizeof(editorrow) * out->capacity);
+    }
+    editorClipText(&out->rows[out->nrows++], s, len);
+}
+
+// splits output into lines, keeping an unfinished last line for the next read
+void editorFilterParse(struct filterOut *out, char *data, int len) {
+    char *p = data, *end = data + len;
+    while (p < end) {
+        char *nl = memchr(p, '\n', end - p);
+        int piece = nl ? nl - p : end - p;
+        if (nl == NULL || out->plen) {
+            if (out->plen + piece > out->pcap) {
+                out->pcap = (out->plen + piece) * 2;
+                out->partial = memRealloc(MEM_FILTER, out->partial, out->pcap);
+            }
+            memcpy(out->partial + out->plen, p, piece);
+            out->plen += piece;
+            if (nl == NULL) break;
+            editorFilterLine(out, out->partial, out->plen);
+            out->plen = 0;
+        } else {
+            editorFilterLine(out, p, piece);
+        }
+        p = nl + 1;
+    }
+}
+
+/* Writes rows from *next up to end to the command, as many as the pipe
+takes, *skip bytes of row *next being already written. Returns 0 once the
+command stopped reading. */
+int editorFilterWrite(int fd, int *next, int end, int *skip) {
+    struct iovec iov[FILTER_IOV];
+    int n = 0;
+    for (int j = *next; j < end && n + 2 <= FILTER_IOV; j++) {
+        editorrow *row = &E.erow[j];
+        int off = j == *next ? *skip : 0;
+        if (off < row->length) iov[n++] = (struct iovec) { row->text + off, row->length - off };
+        iov[n++] = (struct iovec) { "\n", 1 };
+    }
+
+    ssize_t written = writev(fd, iov, n);
+    if (written == -1) return errno == EAGAIN || errno == EINTR;
+    while (written > 0) {
+        int left = E.erow[*next].length + 1 - *skip;
+        if (written < left) {
+            *skip += written;
+            break;
+        }
+        written -= left;
+        (*next)++;
+        *skip = 0;
+    }
+    return 1;
+}
+
+// runs sh -c cmd with pipes on its stdin, stdout and stderr, returns its pid or -1
+pid_t editorFilterSpawn(char *cmd, int fds[3]) {
+    int p[3][2], made = 0;
+    while (made < 3 && pipe2(p[made], O_CLOEXEC) == 0) made++;
+    pid_t pid = made == 3 ? fork() : -1;
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        dup2(p[0][0], STDIN_FILENO);
+        dup2(p[1][1], STDOUT_FILENO);
+        dup2(p[2][1], STDERR_FILENO);
+        execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+
+    for (int i = 0; i < made; i++) {
+        int mine = i == 0; // the write end of stdin, the read end of the others
+        close(p[i][!mine]);
+        fds[i] = p[i][mine];
+        if (pid == -1) {
+            close(fds[i]);
+        } else {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        }
+    }
+    return pid;
+}
+
+// reads pending keys, returns 1 when one of them was ESC or Ctrl-C
+int editorFilterCanceled() {
+    char keys[32];
+    ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+    return n > 0 && (memchr(keys, '\x1b', n) || memchr(keys, CTRL_KEY('c'), n));
+}
+
+/* Replaces rows [at, at + count) with the output of cmd. The buffer is left
+as it was if the command fails or ESC cancels it. */
+void editorFilterRows(int at, int count, char *cmd) {
+    void (*pipeHandler)(int) = signal(SIGPIPE, SIG_IGN); // a command may stop reading early
+    int fds[3];
+    pid_t pid = editorFilterSpawn(cmd, fds);
+    if (pid == -1) {
+        signal(SIGPIPE, pipeHandler);
+        editorSetStatusMessage("Can't run filter: %s", strerror(errno));
+        return;
+    }
+
+    static char buf[STREAM_CHUNK];
+    struct filterOut out;
+    memset(&out, 0, sizeof(out));
+    int next = at, skip = 0, canceled = 0;
+    double start = editorNow(), shown = start;
+    if (count == 0) {
+        close(fds[0]);
+        fds[0] = -1;
+    }
+
+    while (fds[1] != -1 || fds[2] != -1) {
+        struct pollfd pfd[4] = {
+            { fds[0], POLLOUT, 0 }, { fds[1], POLLIN, 0 }, { fds[2], POLLIN, 0 },
+            { M.playing ? -1 : STDIN_FILENO, POLLIN, 0 } // negative fds are skipped
+        };
+        if (poll(pfd, 4, 100) == -1 && errno != EINTR) break;
+
+        if (pfd[3].revents && editorFilterCanceled()) {
+            canceled = 1;
+            break;
+        }
+        if (pfd[0].revents && (!editorFilterWrite(fds[0], &next, at + count, &skip) || next == at + count)) {
+            close(fds[0]); // all sent, or not wanted any more
+            fds[0] = -1;
+        }
+        for (int i = 1; i < 3; i++) {
+            if (!pfd[i].revents) continue;
+            ssize_t nread = read(fds[i], buf, sizeof(buf));
+            if (nread == -1 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (nread <= 0) {
+                close(fds[i]);
+                fds[i] = -1;
+            } else if (i == 1) {
+                editorFilterParse(&out, buf, nread);
+            } else if (out.errlen < FILTER_ERR) {
+                int keep = nread < FILTER_ERR - out.errlen ? nread : FILTER_ERR - out.errlen;
+                memcpy(out.err + out.errlen, buf, keep);
+                out.errlen += keep;
+            }
+        }
+
+        if (!E.batch && editorNow() - shown > 0.25) {
+            editorSetStatusMessage("Filtering %d line(s): %d out, ESC to cancel", count, out.nrows);
+            editorRefreshTerminal();
+            shown = editorNow();
+        }
+    }
+    if (out.plen) editorFilterLine(&out, out.partial, out.plen);
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) close(fds[i]);
+    }
+    if (canceled) kill(pid, SIGTERM);
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR);
+    signal(SIGPIPE, pipeHandler);
+    editorScreenReset(); // the command may have written to /dev/tty
+
+    if (canceled || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        for (int j = 0; j < out.nrows; j++) {
+            editorFreeRow(&out.rows[j]);
+        }
+        out.err[out.errlen] = '\0';
+        out.err[strcspn(out.err, "\n")] = '\0';
+        if (canceled) {
+            editorSetStatusMessage("Filter canceled");
+        } else {
+            editorSetStatusMessage("Filter failed (status %d) %s", WIFEXITED(status) ? WEXITSTATUS(status) : -1, out.err);
+        }
+    } else {
+        int was = count > 0 ? editorOpenAfter(at + count - 1) : editorOpenBefore(at);
+        editorDelRows(at, count);
+        editorAttachRows(at, out.rows, out.nrows);
+        if (out.nrows > 0) {
+            editorHighlightRows(at, out.nrows);
+        } else {
+            editorRowsJoined(at, was);
+        }
+        E.cursorY = at;
+        E.cursorX = 0;
+        editorSetStatusMessage("Filtered %d line(s) into %d in %.2f s", count, out.nrows, editorNow() - start);
+    }
+    memFree(MEM_FILTER, out.rows);
+    memFree(MEM_FILTER, out.partial);
+}
+
+void editorFilter() {
+    int y0, x0, y1, x1;
+    int selected = E.selection != SELECT_NONE && editorSelectionBounds(&y0, &x0, &y1, &x1);
+    if (!selected) {
+        y0 = E.cursorY;
+        y1 = E.cursorY < E.numrows ? E.cursorY : E.cursorY - 1; // past the end: insert the output
+    }
+    E.selection = SELECT_NONE;
+
+    char *cmd = editorPrompt("Filter through: %s (ESC to cancel)", NULL);
+    if (cmd == NULL) return;
+    if (cmd[0]) editorFilterRows(y0, y1 - y0 + 1, cmd);
+    free(cmd);
+}
+
+/*** regex ***/
+
+/* Patterns are parsed to a syntax tree, compiled (Thompson construction) to an
+NFA and matched through a DFA whose states are built lazily, one transition at
+a time, on top of the NFA. Matching never backtracks, so a search is linear in
+the length of the row. Beginning and end of line are fed to the automaton as
+two extra symbols, which lets '^' and '$' be plain transitions. */
+
+#define RE_BOL 256
+#define RE_EOL 257
+#define RE_SYMBOLS 258
+#define RE_CLASS_BYTES ((RE_SYMBOLS + 7) / 8)
+#define RE_MAX_DFA_STATES 256 // cached DFA states, the cache is flushed when full
+
+enum reNodeType {
+    RE_N_EMPTY = 0,
+    RE_N_CLASS,
+    RE_N_CAT,
+    RE_N_ALT,
+    RE_N_STAR,
+    RE_N_PLUS,
+    RE_N_QUEST
+};
+
+typedef struct reNode {
+    int type;
+    struct reNode *left;
+    struct reNode *right;
+    unsigned char cls[RE_CLASS_BYTES]; // symbols matched by a RE_N_CLASS node
+} reNode;
+
+enum reStateType {
+    RE_S_CLASS = 0,
+    RE_S_SPLIT,
+    RE_S_MATCH
+};
+
+typedef struct reState {
+    int type;
+    int out;
+    int out1; // second epsilon edge of a RE_S_SPLIT state
+    unsigned char cls[RE_CLASS_BYTES];
+} reState;
+
+typedef struct reDState {
+    int *set; // sorted NFA states in this DFA state
+    int nset;
+    int accept;
+    int next[RE_SYMBOLS]; // -1 until the transition is computed
+} reDState;
+
+typedef struct reProg {
+    reState *states;
+    int nstates;
+    int start;
+    reDState *dstates;
+    int ndstates;
+    int dstart; // DFA start state, -1 until built
+    int *htab; // open addressing index of dstates by NFA set
+    int *stack;
+    int *work;
+    unsigned int *mark;
+    unsigned int gen;
+} reProg;
+
+typedef struct reRegex {
+    reProg fwd; // anchored, used to extend a match to its longest end
+    reProg rev; // reversed and unanchored, finds the leftmost match start
+} reRegex;
+
+struct reParser {
+    const char *p;
+    int error;
+};
+
+#define RE_HTAB_SIZE (RE_MAX_DFA_STATES * 2)
+
+static void reClassSet(unsigned char *cls, int sym) {
+    cls[sym / 8] |= 1 << (sym % 8);
+}
+
+static int reClassHas(const unsigned char *cls, int sym) {
+    return cls[sym / 8] & (1 << (sym % 8));
+}
+
+static reNode* reNewNode(int type, reNode *left, reNode *right) {
+    reNode *n = memCalloc(MEM_SEARCH, 1, sizeof(reNode));
+    n->type = type;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+static void reFreeNode(reNode *n) {
+    if (n == NULL) return;
+    reFreeNode(n->left);
+    reFreeNode(n->right);
+    memFree(MEM_SEARCH, n);
+}
+
+// adds the class for an escape such as \d, returns 0 for a plain escaped char
+static int reEscapeClass(unsigned char *cls, char e) {
+    int c, negate = isupper((unsigned char)e);
+    int (*test)(int);
+    switch (tolower((unsigned char)e)) {
+        case 'd': test = isdigit; break;
+        case 's': test = isspace; break;
+        case 'w': test = isalnum; break;
+        default: return 0;
+    }
+    for (c = 0; c < 256; c++) {
+        int in = test(c) || (test == isalnum && c == '_');
+        if (in != negate) reClassSet(cls, c);
+    }
+    return 1;
+}
+
+static char reEscapeChar(char e) {
+    switch (e) {
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+        default: return e;
+    }
+}
+
+static reNode* reParseAlt(struct reParser *ps);
+
+static reNode* reParseBracket(struct reParser *ps) {
+    reNode *n = reNewNode(RE_N_CLASS, NULL, NULL);
+    int negate = 0;
+    if (*ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        first = 0;
+        int lo = (unsigned char)*ps->p++;
+        if (lo == '\\' && *ps->p) {
+            if (reEscapeClass(n->cls, *ps->p)) {
+                ps->p++;
+                continue;
+            }
+            lo = (unsigned char)reEscapeChar(*ps->p++);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            ps->p++;
+            hi = (unsigned char)*ps->p++;
+            if (hi == '\\' && *ps->p) hi = (unsigned char)reEscapeChar(*ps->p++);
+        }
+        for (int c = lo; c <= hi; c++) reClassSet(n->cls, c);
+    }
+    if (*ps->p != ']') {
+        ps->error = 1;
+        return n;
+    }
+    ps->p++;
+    if (negate) {
+        for (int i = 0; i < 32; i++) n->cls[i] = ~n->cls[i];
+    }
+    return n;
+}
+
+static reNode* reParseAtom(struct reParser *ps) {
+    reNode *n;
+    char c = *ps->p++;
+    switch (c) {
+        case '(':
+            n = reParseAlt(ps);
+            if (*ps->p != ')') ps->error = 1;
+            else ps->p++;
+            return n;
+        case '[':
+            return reParseBracket(ps);
+        case '.':
+            n = reNewNode(RE_N_CLASS, NULL, NULL);
+            memset(n->cls, 0xff, 32);
+            return n;
+        case '^':
+            n = reNewNode(RE_N_CLASS, NULL, NULL);
+            reClassSet(n->cls, RE_BOL);
+            return n;
+        case '$':
+            n = reNewNode(RE_N_CLASS, NULL, NULL);
+            reClassSet(n->cls, RE_EOL);
+            return n;
+        case '*':
+        case '+':
+        case '?':
+            ps->error = 1; // nothing to repeat
+            return NULL;
+        case '\\':
+            n = reNewNode(RE_N_CLASS, NULL, NULL);
+            if (*ps->p == '\0') {
+                ps->error = 1;
+                return n;
+            }
+            if (!reEscapeClass(n->cls, *ps->p)) {
+                reClassSet(n->cls, (unsigned char)reEscapeChar(*ps->p));
+            }
+            ps->p++;
+            return n;
+        default:
+            n = reNewNode(RE_N_CLASS, NULL, NULL);
+            reClassSet(n->cls, (unsigned char)c);
+            return n;
+    }
+}
+
+static reNode* reParseRepeat(struct reParser *ps) {
+    reNode *n = reParseAtom(ps);
+    while (!ps->error && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+        int type = *ps->p == '*' ? RE_N_STAR : (*ps->p == '+' ? RE_N_PLUS : RE_N_QUEST);
+        n = reNewNode(type, n, NULL);
+        ps->p++;
+    }
+    return n;
+}
+
+static reNode* reParseCat(struct reParser *ps) {
+    reNode *n = NULL;
+    while (!ps->error && *ps->p && *ps->p != '|' && *ps->p != ')') {
+        reNode *next = reParseRepeat(ps);
+        n = n ? reNewNode(RE_N_CAT, n, next) : next;
+    }
+    return n ? n : reNewNode(RE_N_EMPTY, NULL, NULL);
+}
+
+static reNode* reParseAlt(struct reParser *ps) {
+    reNode *n = reParseCat(ps);
+    while (!ps->error && *ps->p == '|') {
+        ps->p++;
+        n = reNewNode(RE_N_ALT, n, reParseCat(ps));
+    }
+    return n;
+}
+
+static int reAddState(reProg *prog, int type, int out, int out1) {
+    prog->states = memRealloc(MEM_SEARCH, prog->states, sizeof(reState) * (prog->nstates + 1));
+    reState *s = &prog->states[prog->nstates];
+    memset(s, 0, sizeof(reState));
+    s->type = type;
+    s->out = out;
+    s->out1 = out1;
+    return prog->nstates++;
+}
+
+// compiles n so that it continues to state next, returns its entry state
+static int reCompileNode(reProg *prog, reNode *n, int next, int reverse) {
+    int s, body;
+    switch (n->type) {
+        case RE_N_CLASS:
+            s = reAddState(prog, RE_S_CLASS, next, -1);
+            memcpy(prog->states[s].cls, n->cls, RE_CLASS_BYTES);
+            return s;
+        case RE_N_CAT:
+            if (reverse) {
+                return reCompileNode(prog, n->right, reCompileNode(prog, n->left, next, reverse), reverse);
+            }
+            return reCompileNode(prog, n->left, reCompileNode(prog, n->right, next, reverse), reverse);
+        case RE_N_ALT:
+            body = reCompileNode(prog, n->left, next, reverse);
+            return reAddState(prog, RE_S_SPLIT, body, reCompileNode(prog, n->right, next, reverse));
+        case RE_N_QUEST:
+            return reAddState(prog, RE_S_SPLIT, reCompileNode(prog, n->left, next, reverse), next);
+        case RE_N_STAR:
+        case RE_N_PLUS:
+            s = reAddState(prog, RE_S_SPLIT, -1, next);
+            body = reCompileNode(prog, n->left, s, reverse);
+            prog->states[s].out = body;
+            return n->type == RE_N_STAR ? s : body;
+        default:
+            return next;
+    }
+}
+
+static void reCompileProg(reProg *prog, reNode *tree, int reverse, int unanchored) {
+    memset(prog, 0, sizeof(reProg));
+    int match = reAddState(prog, RE_S_MATCH, -1, -1);
+    prog->start = reCompileNode(prog, tree, match, reverse);
+    if (unanchored) {
+        // prefix the pattern with a loop over every symbol: (any)*
+        int loop = reAddState(prog, RE_S_SPLIT, prog->start, -1);
+        int any = reAddState(prog, RE_S_CLASS, loop, -1);
+        memset(prog->states[any].cls, 0xff, RE_CLASS_BYTES);
+        prog->states[loop].out1 = any;
+        prog->start = loop;
+    }
+    prog->dstart = -1;
+    prog->stack = memAlloc(MEM_SEARCH, sizeof(int) * prog->nstates);
+    prog->work = memAlloc(MEM_SEARCH, sizeof(int) * prog->nstates);
+    prog->mark = memCalloc(MEM_SEARCH, prog->nstates, sizeof(unsigned int));
+    prog->htab = memAlloc(MEM_SEARCH, sizeof(int) * RE_HTAB_SIZE);
+    for (int i = 0; i < RE_HTAB_SIZE; i++) prog->htab[i] = -1;
+}
+
+static void reFlushDFA(reProg *prog) {
+    for (int i = 0; i < prog->ndstates; i++) memFree(MEM_SEARCH, prog->dstates[i].set);
+    prog->ndstates = 0;
+    prog->dstart = -1;
+    for (int i = 0; i < RE_HTAB_SIZE; i++) prog->htab[i] = -1;
+}
+
+static void reFreeProg(reProg *prog) {
+    reFlushDFA(prog);
+    memFree(MEM_SEARCH, prog->dstates);
+    memFree(MEM_SEARCH, prog->states);
+    memFree(MEM_SEARCH, prog->stack);
+    memFree(MEM_SEARCH, prog->work);
+    memFree(MEM_SEARCH, prog->mark);
+    memFree(MEM_SEARCH, prog->htab);
+    memset(prog, 0, sizeof(reProg));
+}
+
+static int reCompareInt(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// epsilon closure of the n states in prog->work, written back sorted to prog->work
+static int reClosure(reProg *prog, int n) {
+    int sp = 0, count = 0;
+    prog->gen++;
+    for (int i = 0; i < n; i++) prog->stack[sp++] = prog->work[i];
+    while (sp > 0) {
+        int s = prog->stack[--sp];
+        if (s < 0 || prog->mark[s] == prog->gen) continue;
+        prog->mark[s] = prog->gen;
+        if (prog->states[s].type == RE_S_SPLIT) {
+            prog->stack[sp++] = prog->states[s].out1;
+            prog->stack[sp++] = prog->states[s].out;
+        } else {
+            prog->work[count++] = s;
+        }
+    }
+    qsort(prog->work, count, sizeof(int), reCompareInt);
+    return count;
+}
+
+static unsigned int reHashSet(const int *set, int n) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < n; i++) {
+        h = (h ^ (unsigned int)set[i]) * 16777619u;
+    }
+    return h;
+}
+
+// returns the DFA state for the n NFA states in prog->work, building it if needed
+static int reGetDState(reProg *prog, int n) {
+    unsigned int h = reHashSet(prog->work, n) % RE_HTAB_SIZE;
+    while (prog->htab[h] != -1) {
+        reDState *d = &prog->dstates[prog->htab[h]];
+        if (d->nset == n && !memcmp(d->set, prog->work, sizeof(int) * n)) {
+            return prog->htab[h];
+        }
+        h = (h + 1) % RE_HTAB_SIZE;
+    }
+
+    if (prog->ndstates == RE_MAX_DFA_STATES) {
+        reFlushDFA(prog);
+        return reGetDState(prog, n);
+    }
+    if (prog->dstates == NULL) {
+        prog->dstates = memAlloc(MEM_SEARCH, sizeof(reDState) * RE_MAX_DFA_STATES);
+    }
+
+    int idx = prog->ndstates++;
+    reDState *d = &prog->dstates[idx];
+    d->set = memAlloc(MEM_SEARCH, sizeof(int) * (n ? n : 1));
+    memcpy(d->set, prog->work, sizeof(int) * n);
+    d->nset = n;
+    d->accept = 0;
+    for (int i = 0; i < n; i++) {
+        if (prog->states[d->set[i]].type == RE_S_MATCH) d->accept = 1;
+    }
+    for (int i = 0; i < RE_SYMBOLS; i++) d->next[i] = -1;
+    prog->htab[h] = idx;
+    return idx;
+}
+
+static int reStart(reProg *prog) {
+    if (prog->dstart == -1) {
+        prog->work[0] = prog->start;
+        prog->dstart = reGetDState(prog, reClosure(prog, 1));
+    }
+    return prog->dstart;
+}
+
+static int reStep(reProg *prog, int ds, int sym) {
+    reDState *d = &prog->dstates[ds];
+    if (d->next[sym] != -1) return d->next[sym];
+
+    int n = 0;
+    for (int i = 0; i < d->nset; i++) {
+        reState *s = &prog->states[d->set[i]];
+        if (s->type == RE_S_CLASS && reClassHas(s->cls, sym)) {
+            prog->work[n++] = s->out;
+        }
+    }
+    int before = prog->ndstates;
+    int next = reGetDState(prog, reClosure(prog, n));
+    if (prog->ndstates >= before) {
+        // cache was not flushed, so ds is still valid
+        prog->dstates[ds].next[sym] = next;
+    }
+    return next;
+}
+
+// compiles pattern into re, returns -1 when the pattern is malformed
+int reCompile(reRegex *re, const char *pattern) {
+    struct reParser ps = { pattern, 0 };
+    reNode *tree = reParseAlt(&ps);
+    if (!ps.error && *ps.p != '\0') ps.error = 1; // unbalanced ')'
+    if (ps.error) {
+        reFreeNode(tree);
+        return -1;
+    }
+    reCompileProg(&re->fwd, tree, 0, 0);
+    reCompileProg(&re->rev, tree, 1, 1);
+    reFreeNode(tree);
+    return 0;
+}
+
+void reFree(reRegex *re) {
+    reFreeProg(&re->fwd);
+    reFreeProg(&re->rev);
+}
+
+static int reSymbolAt(const char *s, int len, int k) {
+    if (k == 0) return RE_BOL;
+    if (k == len + 1) return RE_EOL;
+    return (unsigned char)s[k - 1];
+}
+
+// end of the longest match starting at symbol index from, or from if none
+static int reLongest(reRegex *re, const char *s, int len, int from) {
+    int end = from;
+    int d = reStart(&re->fwd);
+    for (int k = from; k <= len + 1; k++) {
+        d = reStep(&re->fwd, d, reSymbolAt(s, len, k));
+        if (re->fwd.dstates[d].nset == 0) break;
+        if (re->fwd.dstates[d].accept) end = k + 1;
+    }
+    return end;
+}
+
+/* Finds the leftmost-longest match in s. A reverse scan of the whole line with
+the unanchored reversed automaton finds the leftmost position where a match
+starts, then the anchored forward automaton finds its longest end. Positions
+are symbol indexes: 0 is the line start and len + 1 the line end. */
+int reSearch(reRegex *re, const char *s, int len, int *mstart, int *mlen) {
+    int ks = -1;
+    int d = reStart(&re->rev);
+    for (int k = len + 1; k >= 0; k--) {
+        d = reStep(&re->rev, d, reSymbolAt(s, len, k));
+        if (re->rev.dstates[d].accept) ks = k;
+    }
+    if (ks == -1) return 0;
+
+    int ke = reLongest(re, s, len, ks);
+    if (ks == 0) {
+        // the line start and the first byte share byte offset 0
+        int ke1 = reLongest(re, s, len, 1);
+        if (ke1 > ke) ke = ke1;
+    }
+
+    int start = ks == 0 ? 0 : ks - 1;
+    int end = ke - 1 > len ? len : ke - 1;
+    if (end < start) end = start;
+    *mstart = start;
+    *mlen = end - start;
+    return 1;
+}
+
+/*** find ***/
+
+struct editorSearch {
+    int regex; // 1 when the query is a regular expression
+    char *pattern; // query the automaton below was compiled from
+    int valid; // 0 when pattern failed to compile
+    reRegex re;
+} S;
+
+// compiles query unless it is the pattern already compiled, returns 0 if unusable
+int editorSearchPrepare(char *query) {
+    if (S.pattern && !strcmp(S.pattern, query)) return S.valid;
+
+    if (S.pattern && S.valid) reFree(&S.re);
+    memFree(MEM_SEARCH, S.pattern);
+    S.pattern = memAlloc(MEM_SEARCH, strlen(query) + 1);
+    strcpy(S.pattern, query);
+    S.valid = reCompile(&S.re, query) == 0;
+    return S.valid;
+}
+
+// finds query in erow->render, storing the match offset and length in render chars
+int editorSearchRow(editorrow *erow, char *query, int *mstart, int *mlen) {
+    if (S.regex) {
+        return reSearch(&S.re, erow->render, erow->rsize, mstart, mlen);
+    }
+
+    char *match = strstr(erow->render, query);
+    if (match == NULL) return 0;
+    *mstart = match - erow->render;
+    *mlen = strlen(query);
+    return 1;
+}
+
+void editorFindCallback(char* query, int cur_key) {
+    static int last_match = -1; // last matching text y position
+    static int direction = 1; // 1 for forward annd -1 for backward
+
+    static int saved_hl_line;
+    static char *saved_hl = NULL;
+    
+    if (saved_hl) {
+        memcpy(E.erow[saved_hl_line].hl, saved_hl, E.erow[saved_hl_line].rsize);
+        memFree(MEM_SEARCH, saved_hl);
+        saved_hl = NULL;
+    }
+
+    if (cur_key == '\r' || cur_key == '\x1b') {
+        last_match = -1;
+        direction = 1;
+        return;
+    } else if (cur_key == ARROW_DOWN || cur_key == ARROW_RIGHT) {
+        direction = 1;
+    } else if (cur_key == ARROW_UP || cur_key == ARROW_LEFT) {
+        direction = -1;
+    } else {
+        direction = 1;
+        last_match = -1;
+    }
+
+    if (last_match == -1) {
+        direction = 1;
+    }
+    int current = last_match;
+
+    if (S.regex && !editorSearchPrepare(query)) {
+        editorSetStatusMessage("Invalid regex: %s", query);
+        return;
+    }
+
+    for (int i = 0 ; i < E.numrows ; i++) {
+        current += direction;
+
+        if (current == -1) {
+            current = E.numrows - 1;
+        } else if (current == E.numrows) {
+            current = 0;
+        }
+
+        editorrow* erow = &E.erow[current];
+        editorRowMaterialize(erow);
+        int mstart, mlen;
+        if (editorSearchRow(erow, query, &mstart, &mlen)) {
+            last_match = current;
+            E.cursorY = current;
+            E.cursorX = editorRowRenderCToCursorX(erow, mstart);
+            /* so that we are scrolled to the very bottom of the file, 
+            which will cause editorScroll() to scroll upwards at the next 
+            screen refresh so that the matching line will be at the very 
+            top of the screen.*/
+            E.rowOff = E.numrows;
+
+            saved_hl_line = current;
+            saved_hl = memAlloc(MEM_SEARCH, erow->rsize);
+            memcpy(saved_hl, erow->hl, erow->rsize);
+            memset(&erow->hl[mstart], HL_MATCH, mlen);
+            break; 
+        }
+    }
+}
+
+void editorFind(int regex) {
+    int saved_cursorX = E.cursorX;
+    int saved_cursorY = E.cursorY;
+    int saved_colOff = E.colOff;
+    int saved_rowOff = E.rowOff;
+
+    S.regex = regex;
+    char *query = editorPrompt(regex ? "Regex: %s (Use ESC/Arrows/Enter)" :
+        "Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    
+    if (query) {
+        free(query);
+    } else {
+        E.cursorX = saved_cursorX;
+        E.cursorY = saved_cursorY;
+        E.colOff = saved_colOff;
+        E.rowOff = saved_rowOff;
+    }
+}
+
+/*** goto ***/
+
+void editorGotoOffset(long long offset) {
+    editorLineIndexSync();
+    if (offset < 0) offset = 0;
+
+    int row = rowIndexSearch(&E.lines, offset);
+    if (row >= E.numrows) { // past the end of file, stop at the last char
+        row = E.numrows > 0 ? E.numrows - 1 : 0;
+        offset = rowIndexPrefix(&E.lines, E.numrows);
+    }
+    E.cursorY = row;
+    E.cursorX = 0;
+    if (row < E.numrows) {
+        long long col = offset - rowIndexPrefix(&E.lines, row);
+        E.cursorX = col > E.erow[row].length ? E.erow[row].length : col;
+    }
+}
+
+void editorGotoLine(int line) {
+    if (line < 1) line = 1;
+    if (line > E.numrows) line = E.numrows;
+    E.cursorY = line > 0 ? line - 1 : 0;
+    E.cursorX = 0;
+}
+
+void editorGoto() {
+    char *query = editorPrompt("Goto: %s (line, or @byte offset)", NULL);
+    if (query == NULL) return;
+
+    char *end;
+    if (query[0] == '@') {
+        long long offset = strtoll(&query[1], &end, 10);
+        if (end != &query[1] && *end == '\0') {
+            editorGotoOffset(offset);
+        } else {
+            editorSetStatusMessage("Invalid offset: %s", &query[1]);
+        }
+    } else {
+        long line = strtol(query, &end, 10);
+        if (end != query && *end == '\0') {
+            editorGotoLine(line);
+        } else {
+            editorSetStatusMessage("Invalid line: %s", query);
+        }
+    }
+    E.rowOff = E.numrows; // scroll the target to the top, as search does
+    free(query);
+}
+
+/*** symbols ***/
+
+/* Function, struct and #define definitions, kept sorted by name for the
+outline. Rows whose highlighting changed are marked stale and indexed later,
+a slice at a time while no key is pending, so opening or editing a large
+file never waits on the index. Only code chars count, the hl of a row tells
+comments and strings apart. */
+
+#define SYMBOLS_PER_ROW 4
+
+enum symbolKind {
+    SYM_FUNCTION = 0,
+    SYM_STRUCT,
+    SYM_UNION,
+    SYM_ENUM,
+    SYM_DEFINE
+};
+
+char *symbolKindNames[] = {"function", "struct", "union", "enum", "define"};
+
+struct editorSymbol {
+    char *name;
+    int kind;
+    int line; // row index
+    int col; // render offset of the name
+};
+
+struct symbolMatch {
+    int score;
+    int symbol;
+};
+
+struct editorSymbols {
+    struct editorSymbol *sym; // sorted by name, then line
+    int count;
+    int capacity;
+    int pending; // stale rows
+    int scan; // no stale row before this one
+    struct symbolMatch *matches; // outline prompt candidates, best first
+    int nmatches;
+    int selected;
+} SY;
+
+int editorSymbolsPending() {
+    return SY.pending > 0;
+}
+
+// removes the symbols of rows [at, at + count) and renumbers the ones below
+void editorSymbolsDrop(int at, int count, int shift) {
+    int n = 0;
+    for (int i = 0; i < SY.count; i++) {
+        struct editorSymbol *s = &SY.sym[i];
+        if (s->line >= at && s->line < at + count) {
+            memFree(MEM_SYMBOLS, s->name);
+            continue;
+        }
+        if (shift && s->line >= at + count) s->line -= count;
+        SY.sym[n++] = *s;
+    }
+    SY.count = n;
+    SY.nmatches = 0;
+}
+
+void editorSymbolsStale(editorrow *row) {
+    if (row->symbols == -1 || E.syntax == NULL) return;
+    if (row->symbols > 0) editorSymbolsDrop(row->idx, 1, 0);
+    row->symbols = -1;
+    SY.pending++;
+    if (row->idx < SY.scan) SY.scan = row->idx;
+}
+
+// count rows were inserted at at, their own symbols come from highlighting
+void editorSymbolsInserted(int at, int count) {
+    for (int i = 0; i < SY.count; i++) {
+        if (SY.sym[i].line >= at) SY.sym[i].line += count;
+    }
+    if (SY.scan > at) SY.scan = at;
+}
+
+// rows [at, at + count) are about to be deleted
+void editorSymbolsRemoved(int at, int count) {
+    int dropped = 0;
+    for (int j = at; j < at + count; j++) {
+        if (E.erow[j].symbols == -1) SY.pending--;
+        if (E.erow[j].symbols > 0) dropped = 1;
+    }
+    if (dropped || SY.count) editorSymbolsDrop(at, count, 1);
+    if (SY.scan > at) SY.scan = SY.scan - count > at ? SY.scan - count : at;
+}
+
+// for rows loaded with symbols at -1, without going through highlighting
+void editorSymbolsAllStale() {
+    SY.pending = E.numrows;
+    SY.scan = 0;
+    SY.nmatches = 0;
+}
+
+void editorSymbolsClear() {
+    for (int i = 0; i < SY.count; i++) memFree(MEM_SYMBOLS, SY.sym[i].name);
+    SY.count = 0;
+    SY.pending = 0;
+    SY.scan = 0;
+    SY.nmatches = 0;
+}
+
+int editorSymbolCompare(struct editorSymbol *a, const char *name, int line) {
+    int c = strcmp(a->name, name);
+    return c ? c : a->line - line;
+}
+
+void editorSymbolAdd(int kind, editorrow *row, int col, int len) {
+    char *name = memAlloc(MEM_SYMBOLS, len + 1);
+    memcpy(name, &row->render[col], len);
+    name[len] = '\0';
+
+    int lo = 0, hi = SY.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (editorSymbolCompare(&SY.sym[mid], name, row->idx) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    if (SY.count == SY.capacity) {
+        SY.capacity = SY.capacity ? SY.capacity * 2 : 64;
+        SY.sym = memRealloc(MEM_SYMBOLS, SY.sym, SY.capacity * sizeof(*SY.sym));
+    }
+    memmove(&SY.sym[lo + 1], &SY.sym[lo], (SY.count - lo) * sizeof(*SY.sym));
+    SY.sym[lo] = (struct editorSymbol){name, kind, row->idx, col};
+    SY.count++;
+}
+
+int isCodeChar(editorrow *row, int i) {
+    unsigned char hl = row->hl[i];
+    return hl != HL_COMMENT && hl != HL_MLCOMMENT && hl != HL_STRING;
+}
+
+int isIdentChar(int c) {
+    return isalnum(c) || c == '_';
+}
+
+// length of the identifier at render offset i, 0 if there is none
+int editorIdentAt(editorrow *row, int i) {
+    int j = i;
+    if (i < row->rsize && isdigit((unsigned char)row->render[i])) return 0;
+    while (j < row->rsize && isIdentChar((unsigned char)row->render[j]) && isCodeChar(row, j)) j++;
+    return j - i;
+}
+
+int editorSkipSpaces(editorrow *row, int i) {
+    while (i < row->rsize && isspace((unsigned char)row->render[i])) i++;
+    return i;
+}
+
+int editorWordIs(editorrow *row, int i, int len, const char *word) {
+    return len == (int)strlen(word) && !memcmp(&row->render[i], word, len);
+}
+
+/* Finds the definitions starting on row: "#define NAME", "struct NAME {"
+with the brace possibly on a later row, and a function header, an
+identifier followed by '(' on a row starting at column 0 that does not end
+in ';' the way a prototype does. */
+int editorIndexRow(editorrow *row) {
+    char *r = row->render;
+    int n = row->rsize, found = 0;
+
+    int i = editorSkipSpaces(row, 0);
+    if (i < n && r[i] == '#' && isCodeChar(row, i)) {
+        i = editorSkipSpaces(row, i + 1);
+        int len = editorIdentAt(row, i);
+        if (editorWordIs(row, i, len, "define")) {
+            i = editorSkipSpaces(row, i + len);
+            len = editorIdentAt(row, i);
+            if (len) editorSymbolAdd(SYM_DEFINE, row, i, len), found++;
+        }
+        return found;
+    }
+
+    int last = n - 1; // last code char
+    while (last >= 0 && (isspace((unsigned char)r[last]) || !isCodeChar(row, last))) last--;
+
+    int paren = -1, assigned = 0;
+    for (i = 0; i < n && found < SYMBOLS_PER_ROW; i++) {
+        if (!isCodeChar(row, i)) continue;
+        if (r[i] == '=' && paren == -1) assigned = 1;
+        if (r[i] == '(' && paren == -1) paren = i;
+        if (!isIdentChar((unsigned char)r[i]) || (i > 0 && isIdentChar((unsigned char)r[i - 1]))) continue;
+
+        int len = editorIdentAt(row, i), kind = -1;
+        if (editorWordIs(row, i, len, "struct")) kind = SYM_STRUCT;
+        if (editorWordIs(row, i, len, "union")) kind = SYM_UNION;
+        if (editorWordIs(row, i, len, "enum")) kind = SYM_ENUM;
+        if (kind != -1) {
+            int name = editorSkipSpaces(row, i + len);
+            int nlen = editorIdentAt(row, name);
+            int next = editorSkipSpaces(row, name + nlen);
+            if (nlen && (next >= n || r[next] == '{')) {
+                editorSymbolAdd(kind, row, name, nlen);
+                found++;
+            }
+        }
+    }
+
+    if (paren > 0 && !assigned && n > 0 && isIdentChar((unsigned char)r[0]) &&
+        last >= 0 && r[last] != ';') {
+        int end = paren;
+        while (end > 0 && r[end - 1] == ' ') end--;
+        int start = end;
+        while (start > 0 && isIdentChar((unsigned char)r[start - 1])) start--;
+        if (start < end && row->hl[start] == HL_NORMAL && !isdigit((unsigned char)r[start])) {
+            editorSymbolAdd(SYM_FUNCTION, row, start, end - start);
+            found++;
+        }
+    }
+    return found;
+}
+
+/* Indexes a lazy row through a scratch render and highlighting, so that
+background indexing leaves it lazy. Only the comment state found is kept,
+which the next row down needs. */
+int editorIndexLazyRow(editorrow *row) {
+    static char *render;
+    static unsigned char *hl;
+    static int cap;
+
+    int size = row->length + 1;
+    for (int i = 0; i < row->length; i++) {
+        if (row->text[i] == '\t') size += EDITOR_TAB - 1;
+    }
+    if (size > cap) {
+        cap = size * 2;
+        render = memRealloc(MEM_SYMBOLS, render, cap);
+        hl = memRealloc(MEM_SYMBOLS, hl, cap);
+    }
+    int n = 0;
+    for (int i = 0; i < row->length; i++) {
+        if (row->text[i] == '\t') {
+            do render[n++] = ' '; while (n % EDITOR_TAB != 0);
+        } else {
+            render[n++] = row->text[i];
+        }
+    }
+    render[n] = '\0';
+
+    if (row->idx > 0) editorOpenAfter(row->idx - 1); // the highlighter reads the state above
+    editorrow scratch = *row;
+    scratch.render = render;
+    scratch.hl = hl;
+    scratch.rsize = n;
+    E.highlight(&scratch);
+    row->hl_open_comment = scratch.hl_open_comment;
+    return editorIndexRow(&scratch);
+}
+
+// indexes stale rows for up to budget seconds, returns whether any are left
+int editorSymbolsIndex(double budget) {
+    double start = editorNow();
+    while (SY.pending > 0 && SY.scan < E.numrows) {
+        editorrow *row = &E.erow[SY.scan++];
+        if (row->symbols != -1) continue;
+        row->symbols = row->lazy ? editorIndexLazyRow(row) : editorIndexRow(row);
+        SY.pending--;
+        SY.nmatches = 0;
+        if ((SY.scan & 255) == 0 && editorNow() - start > budget) break;
+    }
+    if (SY.scan >= E.numrows) SY.pending = 0;
+    return SY.pending > 0;
+}
+
+/* Scores query as a case insensitive subsequence of name, -1 if it is not
+one. Consecutive chars and chars starting a word score higher, so "ufr"
+prefers editorUpdateFrame over editorBufferRead. */
+int editorFuzzyScore(const char *name, const char *query) {
+    int score = 0, prev = -2, j = 0;
+    for (int i = 0; name[i] && query[j]; i++) {
+        if (tolower((unsigned char)name[i]) != tolower((unsigned char)query[j])) continue;
+        score += 1;
+        if (prev == i - 1) score += 5;
+        if (i == 0 || name[i - 1] == '_' ||
+            (islower((unsigned char)name[i - 1]) && isupper((unsigned char)name[i]))) score += 3;
+        prev = i;
+        j++;
+    }
+    if (query[j]) return -1;
+    return score;
+}
+
+int editorMatchCompare(const void *a, const void *b) {
+    const struct symbolMatch *x = a, *y = b;
+    if (x->score != y->score) return y->score - x->score;
+    int lx = strlen(SY.sym[x->symbol].name), ly = strlen(SY.sym[y->symbol].name);
+    if (lx != ly) return lx - ly;
+    return x->symbol - y->symbol; // sorted by name already
+}
+
+void editorOutlineFilter(char *query) {
+    SY.matches = memRealloc(MEM_SYMBOLS, SY.matches, (SY.count + 1) * sizeof(*SY.matches));
+    SY.nmatches = 0;
+    for (int i = 0; i < SY.count; i++) {
+        int score = editorFuzzyScore(SY.sym[i].name, query);
+        if (score >= 0) SY.matches[SY.nmatches++] = (struct symbolMatch){score, i};
+    }
+    qsort(SY.matches, SY.nmatches, sizeof(*SY.matches), editorMatchCompare);
+    SY.selected = 0;
+}
 
-        editorInsertRow(E.numrows, line, linelen);
+void editorOutlineCallback(char *query, int cur_key) {
+    if (cur_key == '\r' || cur_key == '\x1b') return;
+
+    if (cur_key == ARROW_DOWN || cur_key == ARROW_RIGHT) {
+        if (SY.nmatches) SY.selected = (SY.selected + 1) % SY.nmatches;
+    } else if (cur_key == ARROW_UP || cur_key == ARROW_LEFT) {
+        if (SY.nmatches) SY.selected = (SY.selected + SY.nmatches - 1) % SY.nmatches;
+    } else {
+        editorOutlineFilter(query);
     }
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0; // when file is opened, there are no unsaved changes.
+    if (SY.nmatches == 0) {
+        editorSetStatusMessage("Outline: %s (no match)", query);
+        return;
+    }
+    struct editorSymbol *s = &SY.sym[SY.matches[SY.selected].symbol];
+    E.cursorY = s->line;
+    E.cursorX = editorRowRenderCToCursorX(&E.erow[s->line], s->col);
+    E.rowOff = E.numrows; // scroll the definition to the top, as search does
+    editorSetStatusMessage("Outline: %s -> %s %s (%d/%d)", query,
+        symbolKindNames[s->kind], s->name, SY.selected + 1, SY.nmatches);
 }
 
-// caller should free the memory of pointer returned
-char* editorRowsToString(int *len) {
-    int total = 0;
-    int i = 0;
-    for (i = 0 ; i < E.numrows ; i++) {
-        total += E.erow[i].length + 1; // +1 for '\n'
+void editorOutline() {
+    if (E.syntax == NULL) {
+        editorSetStatusMessage("No outline without a filetype");
+        return;
     }
+    int saved_cursorX = E.cursorX;
+    int saved_cursorY = E.cursorY;
+    int saved_colOff = E.colOff;
+    int saved_rowOff = E.rowOff;
 
-    *len = total;
+    editorSymbolsIndex(1e9); // finish what the background indexing left
+    editorOutlineFilter("");
 
-    char *buffer = malloc(total);
-    char *temp = buffer;
-    i = 0;
-    for (i = 0 ; i < E.numrows ; i++) {
-        memcpy(temp, E.erow[i].text, E.erow[i].length);
-        temp += E.erow[i].length;
-        temp[0] = '\n';
-        temp++;
+    char *query = editorPrompt("Outline: %s (Use ESC/Arrows/Enter)", editorOutlineCallback);
+    if (query) {
+        free(query);
+    } else {
+        E.cursorX = saved_cursorX;
+        E.cursorY = saved_cursorY;
+        E.colOff = saved_colOff;
+        E.rowOff = saved_rowOff;
     }
+}
+
+/*** stats ***/
 
-    return buffer;
+#define STATS_LINES 32
+#define STATS_COLS 80
+
+long long editorRSS() {
+    long long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%lld %lld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * sysconf(_SC_PAGESIZE);
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+// formats the memory and profiling report into lines, returns the line count
+int editorStatsReport(char lines[][STATS_COLS]) {
+    int n = 0;
+    long long fileBytes = editorRowOffset(E.numrows);
+    long long rss = editorRSS();
+
+    snprintf(lines[n++], STATS_COLS, "%-14s %14s %14s %12s", "memory", "bytes", "peak", "allocs");
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        struct memStat *m = &ST.mem[i];
+        snprintf(lines[n++], STATS_COLS, "%-14s %14lld %14lld %12lld",
+            memSubsystemNames[i], m->bytes, m->peak, m->allocs);
+    }
+    snprintf(lines[n++], STATS_COLS, "%-14s %14lld %14lld", "total", ST.bytes, ST.peak);
+    snprintf(lines[n++], STATS_COLS, "%s", "");
+    int lazy = 0;
+    for (int j = 0; j < E.numrows; j++) lazy += E.erow[j].lazy;
+    snprintf(lines[n++], STATS_COLS, "rows %d (%d lazy), file bytes %lld, heap bytes per row %.1f",
+        E.numrows, lazy, fileBytes, E.numrows ? (double)ST.bytes / E.numrows : 0.0);
+    if (H.active) {
+        fileBytes = H.size;
+        snprintf(lines[n++], STATS_COLS, "hex view of %lld bytes, %d overwritten", H.size, H.nedits);
+    }
+    snprintf(lines[n++], STATS_COLS, "rss %lld bytes, %.1fx the file size",
+        rss, fileBytes ? (double)rss / fileBytes : 0.0);
+    if (ST.timing) {
+        snprintf(lines[n++], STATS_COLS, "editorUpdateRow: %lld calls, %.3f s",
+            ST.updateRowCalls, ST.updateRowTime);
+        snprintf(lines[n++], STATS_COLS, "editorUpdateSyntax: %lld calls, %lld rows, %.3f s",
+            ST.syntaxCalls, ST.syntaxRows, ST.syntaxTime);
     }
+    if (ST.prefetchRows) {
+        snprintf(lines[n++], STATS_COLS, "prefetch: %lld of %lld lazy rows made ready while idle, %.3f s",
+            ST.prefetchRows, ST.lazyRendered, ST.prefetchTime);
+    }
+    if (ST.framesDrawn) {
+        snprintf(lines[n++], STATS_COLS, "frames: %lld drawn, %lld skipped, %.1f fps (peak %.1f), interval %.1f ms",
+            ST.framesDrawn, ST.framesSkipped, ST.fps, ST.peakFps, E.frameInterval * 1000);
+        snprintf(lines[n++], STATS_COLS, "output: %lld bytes, %.0f per frame, %d in the last one",
+            ST.outputBytes, (double)ST.outputBytes / ST.framesDrawn, ST.frameBytes);
+    }
+    return n;
+}
 
-    int len;
-    char *buf = editorRowsToString(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editorSetStatusMessage("%d bytes written to disk", len);
-                E.dirty = 0; // changes saved successfully
-                return;
-            }
+void editorDrawStatsPanel(struct AppendBuffer *ab) {
+    char lines[STATS_LINES][STATS_COLS];
+    int n = editorStatsReport(lines);
+    for (int i = 0; i < E.screenrows; i++) {
+        if (i < n) {
+            int len = strlen(lines[i]);
+            if (len > E.screencols) len = E.screencols;
+            abAppend(ab, lines[i], len);
+        } else {
+            abAppend(ab, "~", 1);
         }
-        close(fd);
+        abAppend(ab, "\x1b[K", 3);
+        abAppend(ab, "\r\n", 2);
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-/*** find ***/
+// loads file and prints the report, for --stats
+int editorPrintStats(char *file) {
+    char lines[STATS_LINES][STATS_COLS];
+    ST.timing = 1;
 
-void editorFindCallback(char* query, int cur_key) {
-    static int last_match = -1; // last matching text y position
-    static int direction = 1; // 1 for forward annd -1 for backward
+    double start = editorNow();
+    editorOpen(file);
+    double load = editorNow() - start;
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-    
-    if (saved_hl) {
-        memcpy(E.erow[saved_hl_line].hl, saved_hl, E.erow[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+    printf("%s: loaded in %.3f s\n", file, load);
+    int n = editorStatsReport(lines);
+    for (int i = 0; i < n; i++) {
+        printf("%s\n", lines[i]);
     }
+    return 0;
+}
 
-    if (cur_key == '\r' || cur_key == '\x1b') {
-        last_match = -1;
-        direction = 1;
-        return;
-    } else if (cur_key == ARROW_DOWN || cur_key == ARROW_RIGHT) {
-        direction = 1;
-    } else if (cur_key == ARROW_UP || cur_key == ARROW_LEFT) {
-        direction = -1;
-    } else {
-        direction = 1;
-        last_match = -1;
+/*** prefetch ***/
+
+/* Lazy rows, from the open cache, a paste or a filter, get their render and
+highlighting when first drawn, which can stall the frame after a jump. While
+no key is queued, the rows of the screen, PREFETCH_PAGES screens in the
+direction the view last moved and one screen against it are made ready in
+that order, in slices of PREFETCH_SLICE_MS that stop as soon as a key
+arrives. Within a range rows go top down, so each one finds the comment
+state of the row above already known. */
+
+// the row ranges to make ready, most urgent first, returns their count
+int editorPrefetchRanges(int lo[3], int hi[3]) {
+    if (H.active || E.numrows == 0) return 0;
+    if (E.rowOff != E.prefetchTop) {
+        E.scrollDir = E.rowOff > E.prefetchTop ? 1 : -1;
+        E.prefetchTop = E.rowOff;
     }
 
-    if (last_match == -1) {
-        direction = 1;
+    int top = E.rowOff, page = E.screenrows, ahead = PREFETCH_PAGES * page;
+    lo[0] = top;
+    hi[0] = top + page;
+    lo[1] = E.scrollDir < 0 ? top - ahead : top + page;
+    hi[1] = E.scrollDir < 0 ? top : top + page + ahead;
+    lo[2] = E.scrollDir < 0 ? top + page : top - page;
+    hi[2] = E.scrollDir < 0 ? top + 2 * page : top;
+    for (int r = 0; r < 3; r++) {
+        if (lo[r] < 0) lo[r] = 0;
+        if (hi[r] > E.numrows) hi[r] = E.numrows;
     }
-    int current = last_match;
-
-    for (int i = 0 ; i < E.numrows ; i++) {
-        current += direction;
+    return 3;
+}
 
-        if (current == -1) {
-            current = E.numrows - 1;
-        } else if (current == E.numrows) {
-            current = 0;
+int editorPrefetchPending() {
+    int lo[3], hi[3], n = editorPrefetchRanges(lo, hi);
+    for (int r = 0; r < n; r++) {
+        for (int j = lo[r]; j < hi[r]; j++) {
+            if (E.erow[j].lazy) return 1;
         }
+    }
+    return 0;
+}
 
-        editorrow* erow = &E.erow[current];
-        char *match = strstr(erow->render, query);
-        if (match) {
-            last_match = current;
-            E.cursorY = current;
-            E.cursorX = editorRowRenderCToCursorX(erow, match - erow->render);
-            /* so that we are scrolled to the very bottom of the file, 
-            which will cause editorScroll() to scroll upwards at the next 
-            screen refresh so that the matching line will be at the very 
-            top of the screen.*/
-            E.rowOff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(erow->rsize);
-            memcpy(saved_hl, erow->hl, erow->rsize);
-            memset(&erow->hl[match - erow->render], HL_MATCH, strlen(query));
-            break; 
+// makes lazy rows around the view ready for up to budget seconds, returns whether any are left
+int editorPrefetch(double budget) {
+    double start = editorNow();
+    long long rendered = ST.lazyRendered;
+    int lo[3], hi[3], n = editorPrefetchRanges(lo, hi), done = 0, left = 0;
+    for (int r = 0; r < n && !left; r++) {
+        for (int j = lo[r]; j < hi[r]; j++) {
+            if (!E.erow[j].lazy) continue;
+            editorRowMaterialize(&E.erow[j]);
+            if ((++done & 15) == 0 && (editorNow() - start > budget || editorInputPending())) {
+                left = 1;
+                break;
+            }
         }
     }
+    ST.prefetchRows += ST.lazyRendered - rendered; // with the rows their highlighting carried on to
+    ST.prefetchTime += editorNow() - start;
+    return left || editorPrefetchPending();
 }
 
-void editorFind() {
-    int saved_cursorX = E.cursorX;
-    int saved_cursorY = E.cursorY;
-    int saved_colOff = E.colOff;
-    int saved_rowOff = E.rowOff;
+/*** output ***/
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
-    
-    if (query) {
-        free(query);
-    } else {
-        E.cursorX = saved_cursorX;
-        E.cursorY = saved_cursorY;
-        E.colOff = saved_colOff;
-        E.rowOff = saved_rowOff;
+// draws len render chars of row starting at start, with their highlighting
+void editorDrawRender(struct AppendBuffer *ab, editorrow *row, int start, int len) {
+    char *c = &row->render[start];
+    unsigned char *hl = &row->hl[start];
+    int current_color = -1; // default color
+    int s0, s1, selected = 0;
+    editorSelectionSpan(row, &s0, &s1);
+    for (int j = 0; j < len; j++) {
+        int sel = start + j >= s0 && start + j < s1;
+        if (sel != selected) {
+            abAppend(ab, sel ? "\x1b[7m" : "\x1b[27m", sel ? 4 : 5);
+            selected = sel;
+        }
+        if (iscntrl(c[j])) {
+            char sym = (c[j] <= 26) ? '@' + c[j] : '?';
+            abAppend(ab, "\x1b[7m", 4);
+            abAppend(ab, &sym, 1);
+            abAppend(ab, "\x1b[m", 3);
+            if (selected) abAppend(ab, "\x1b[7m", 4);
+            if (current_color != -1) {
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+                abAppend(ab, buf, clen);
+            }
+        } else if (hl[j] == HL_NORMAL) {
+            if (current_color != -1) {
+                abAppend(ab, "\x1b[39m", 5);
+                current_color = -1;
+            }
+            abAppend(ab, &c[j], 1);
+        } else {
+            int color = editorSyntaxToColor(hl[j]);
+            if (current_color != color) {
+                current_color = color;
+                char buf[16];
+                int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                abAppend(ab, buf, clen);
+            }
+            abAppend(ab, &c[j], 1);
+        }
     }
+    if (selected) abAppend(ab, "\x1b[27m", 5);
+    abAppend(ab, "\x1b[39m", 5);
 }
 
-/*** output ***/
-
 void editorDrawRows(struct AppendBuffer* ab) {
+    if (E.statsPanel) {
+        editorDrawStatsPanel(ab);
+        return;
+    }
+    if (H.active) {
+        editorHexDrawRows(ab);
+        return;
+    }
+
+    int wrapRow = E.rowOff, wrapSub = E.wrapOff;
     for (int i = 0 ; i < E.screenrows ; i++) {
-        int fileRow = i + E.rowOff;
+        int fileRow = E.softWrap ? wrapRow : i + E.rowOff;
+        if (fileRow < E.numrows) editorRowMaterialize(&E.erow[fileRow]);
         if (fileRow >= E.numrows) {
             if (E.numrows == 0 && i == E.screenrows / 2) {
                 char welcome[80];
@@ -794,6 +5109,14 @@ void editorDrawRows(struct AppendBuffer* ab) {
             } else {
                 abAppend(ab, "~", 1);
             }  
+        } else if (E.softWrap) {
+            editorrow *row = &E.erow[fileRow];
+            int start = editorWrapStart(row, wrapSub);
+            editorDrawRender(ab, row, start, editorWrapEnd(row, wrapSub) - start);
+            if (++wrapSub > row->nwrap) {
+                wrapRow++;
+                wrapSub = 0;
+            }
         } else {
             int len = E.erow[fileRow].rsize - E.colOff;
 
@@ -804,38 +5127,7 @@ void editorDrawRows(struct AppendBuffer* ab) {
                 len = E.screencols;
             }
 
-            char *c = &E.erow[fileRow].render[E.colOff];
-            unsigned char *hl = &E.erow[fileRow].hl[E.colOff];
-            int current_color = -1; // default color
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (current_color != color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-            }
-            abAppend(ab, "\x1b[39m", 5);
+            editorDrawRender(ab, &E.erow[fileRow], E.colOff, len);
         }
         
         abAppend(ab, "\x1b[K", 3); // clear rest of current line
@@ -847,10 +5139,19 @@ void editorDrawStatusBar(struct AppendBuffer *ab) {
     abAppend(ab, "\x1b[7m", 4); // inverted colors on
     
     char status[80], lineStatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
-        E.filename ? E.filename : "[No Name]", E.numrows,
-        E.dirty ? "(modified)" : "");
-    int lineLen = snprintf(lineStatus, sizeof(lineStatus), "%s | %d:%d", E.syntax ? E.syntax->filetype : "no filetype", E.cursorY + 1, E.numrows);
+    int len, lineLen;
+    if (H.active) {
+        len = snprintf(status, sizeof(status), "%.20s - %lld bytes %s",
+            E.filename, H.size, E.dirty ? "(modified)" : "");
+        lineLen = snprintf(lineStatus, sizeof(lineStatus), "hex%s | @%lld 0x%llx",
+            H.ascii ? " chars" : "", H.cursor, H.cursor);
+    } else {
+        len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
+            E.filename ? E.filename : "[No Name]", E.numrows,
+            E.dirty ? "(modified)" : "");
+        lineLen = snprintf(lineStatus, sizeof(lineStatus), "%s | %d:%d | @%lld", E.syntax ? E.syntax->filetype : "no filetype", E.cursorY + 1, E.numrows,
+            editorRowOffset(E.cursorY) + E.cursorX);
+    }
 
     if (len > E.screencols) {
         len = E.screencols;
@@ -882,11 +5183,32 @@ void editorDrawMessageBar(struct AppendBuffer *ab) {
 }
 
 void editorScroll() {
+    if (H.active) {
+        editorHexScroll();
+        return;
+    }
     E.renderX = 0;
     if (E.cursorY < E.numrows) {
         E.renderX = editorRowCursorXToRenderX(&E.erow[E.cursorY], E.cursorX);
     }
 
+    if (E.softWrap) {
+        long long line = editorWrapCursorLine();
+        long long top = editorWrapTopLine();
+        if (line < top) top = line;
+        if (line >= top + E.screenrows) top = line - E.screenrows + 1;
+        editorWrapLocate(top, &E.rowOff, &E.wrapOff);
+
+        E.colOff = 0;
+        E.screenCursorY = line - top;
+        E.screenCursorX = E.renderX;
+        if (E.cursorY < E.numrows) {
+            editorrow *row = &E.erow[E.cursorY];
+            E.screenCursorX -= editorWrapStart(row, editorWrapSubLine(row, E.renderX));
+        }
+        return;
+    }
+
     if (E.cursorY < E.rowOff) { // going past top of the screen
         E.rowOff = E.cursorY;
     }
@@ -902,28 +5224,155 @@ void editorScroll() {
     if (E.renderX >= E.screencols + E.colOff) { // going past right of the screen
         E.colOff = E.renderX - E.screencols + 1;
     }
+
+    E.screenCursorY = E.cursorY - E.rowOff;
+    E.screenCursorX = E.renderX - E.colOff;
+}
+
+/* Sends only the lines of frame that differ from what is on screen. When
+the text area moved vertically, the lines still valid are first shifted in
+place with a scroll region, so scrolling one line sends a single row. */
+void editorDrawChanged(struct AppendBuffer *ab, struct AppendBuffer *frame) {
+    int nlines = E.screenrows + 2; // text rows, status bar and message bar
+    char *line[nlines];
+    int len[nlines];
+    unsigned long long hash[nlines];
+
+    char *p = frame->buffer, *end = frame->buffer + frame->length;
+    for (int i = 0; i < nlines; i++) {
+        char *eol = i < nlines - 1 ? memmem(p, end - p, "\r\n", 2) : NULL;
+        line[i] = p;
+        len[i] = eol ? eol - p : end - p;
+        hash[i] = editorHashLine(p, len[i]);
+        p = eol ? eol + 2 : end;
+    }
+
+    long long top = H.active ? H.top / HEX_ROW_BYTES : E.softWrap ? editorWrapTopLine() : E.rowOff;
+    if (!E.screenLines) { // nothing known about the screen yet
+        E.screenLines = memAlloc(MEM_APPEND_BUFFER, nlines * sizeof(*E.screenLines));
+        memcpy(E.screenLines, hash, sizeof(hash));
+        E.screenTop = top;
+        abAppend(ab, "\x1b[H", 3);
+        abAppend(ab, frame->buffer, frame->length);
+        return;
+    }
+
+    char buf[32];
+    long long d = top - E.screenTop;
+    if (d != 0 && d > -E.screenrows && d < E.screenrows) {
+        int shifted = 0, kept = 0;
+        for (int i = 0; i < E.screenrows; i++) {
+            long long from = i + d;
+            if (from >= 0 && from < E.screenrows && E.screenLines[from] == hash[i]) shifted++;
+            if (E.screenLines[i] == hash[i]) kept++;
+        }
+        if (shifted > kept) {
+            int n = snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%lld%c\x1b[r",
+                E.screenrows, d > 0 ? d : -d, d > 0 ? 'S' : 'T');
+            abAppend(ab, buf, n);
+
+            // the uncovered lines are blank, 0 stands for a line never drawn
+            int keep = E.screenrows - (d > 0 ? d : -d);
+            if (d > 0) {
+                memmove(E.screenLines, E.screenLines + d, keep * sizeof(*E.screenLines));
+                memset(E.screenLines + keep, 0, (E.screenrows - keep) * sizeof(*E.screenLines));
+            } else {
+                memmove(E.screenLines - d, E.screenLines, keep * sizeof(*E.screenLines));
+                memset(E.screenLines, 0, -d * sizeof(*E.screenLines));
+            }
+        }
+    }
+    E.screenTop = top;
+
+    for (int i = 0; i < nlines; i++) {
+        if (E.screenLines[i] == hash[i]) continue;
+        int n = snprintf(buf, sizeof(buf), "\x1b[%d;1H", i + 1);
+        abAppend(ab, buf, n);
+        abAppend(ab, line[i], len[i]);
+        E.screenLines[i] = hash[i];
+    }
+}
+
+// forgets what is on screen, the next frame is drawn in full over whatever
+// other processes sharing the terminal wrote to it
+void editorScreenReset() {
+    memFree(MEM_APPEND_BUFFER, E.screenLines);
+    E.screenLines = NULL;
 }
 
 void editorRefreshTerminal() {
+    double start = editorNow();
     editorScroll();
 
+    struct AppendBuffer frame = APPEND_BUFFER_INIT;
+    editorDrawRows(&frame);
+    editorDrawStatusBar(&frame);
+    editorDrawMessageBar(&frame);
+
     struct AppendBuffer ab = APPEND_BUFFER_INIT;
 
+    abAppend(&ab, "\x1b[?2026h", 8); // synchronized update, shown at once where supported
     abAppend(&ab, "\x1b[?25l", 6); // hide cursor
-    abAppend(&ab, "\x1b[H", 3); // bring cursor back up
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorDrawChanged(&ab, &frame);
 
     char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.cursorY - E.rowOff + 1, E.renderX - E.colOff + 1); // cursorX and cursorY are 0 indexed
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", E.screenCursorY + 1, E.screenCursorX + 1); // screen cursor is 0 indexed
     abAppend(&ab, buf, strlen(buf));
 
     abAppend(&ab, "\x1b[?25h", 6); // show cursor
+    abAppend(&ab, "\x1b[?2026l", 8);
 
     write(STDOUT_FILENO, ab.buffer, ab.length);
+    ST.outputBytes += ab.length;
+    ST.frameBytes = ab.length;
     abFree(&ab);
+    abFree(&frame);
+
+    editorFrameDrawn(start);
+}
+
+// accounts a frame and adapts the pacing to what it cost
+void editorFrameDrawn(double start) {
+    double now = editorNow();
+    E.frameTime = now;
+    E.framePending = 0;
+
+    // write() blocks once the terminal falls behind, so a slow terminal
+    // shows up in the cost and stretches the interval
+    double cost = now - start;
+    E.frameCost = E.frameCost ? (E.frameCost * 7 + cost) / 8 : cost;
+    E.frameInterval = 2 * E.frameCost;
+    if (E.frameInterval < 1.0 / FRAME_RATE) E.frameInterval = 1.0 / FRAME_RATE;
+    if (E.frameInterval > FRAME_MAX_INTERVAL) E.frameInterval = FRAME_MAX_INTERVAL;
+
+    ST.framesDrawn++;
+    ST.fpsFrames++;
+    if (now - ST.fpsStart >= 1) {
+        ST.fps = ST.fpsFrames / (now - ST.fpsStart);
+        if (ST.fps > ST.peakFps) ST.peakFps = ST.fps;
+        ST.fpsStart = now;
+        ST.fpsFrames = 0;
+    }
+}
+
+int editorInputPending() {
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&fd, 1, 0) > 0;
+}
+
+/* Redraws unless a frame was drawn less than an interval ago and more keys
+are already queued, as under key repeat: those intermediate states are
+skipped and the wait for the next key draws once input goes idle. */
+void editorRefreshPaced() {
+    if (E.batch) return; // a replay draws once, at its end
+    if (editorNow() - E.frameTime < E.frameInterval && editorInputPending()) {
+        editorScroll(); // keys like PAGE_DOWN move relative to the viewport
+        E.framePending = 1;
+        ST.framesSkipped++;
+        return;
+    }
+    editorRefreshTerminal();
 }
 
 void editorSetStatusMessage(const char *formatstr, ...) {
@@ -949,7 +5398,9 @@ void editorMoveCursor(int c) {
             }
             break;
         case ARROW_DOWN:
-            if (E.cursorY < E.numrows) { // allow scroll till one line past end of file
+            if (E.softWrap) {
+                editorWrapMoveCursor(1);
+            } else if (E.cursorY < E.numrows) { // allow scroll till one line past end of file
                 E.cursorY++;
             }
             break;
@@ -962,7 +5413,9 @@ void editorMoveCursor(int c) {
             }
             break;
         case ARROW_UP:
-            if (E.cursorY != 0) {
+            if (E.softWrap) {
+                editorWrapMoveCursor(-1);
+            } else if (E.cursorY != 0) {
                 E.cursorY--;
             }
             break;
@@ -975,10 +5428,22 @@ void editorMoveCursor(int c) {
     }
 }
 
-void editorProcessKey() {
-    int c = editorReadKey();
+void editorHandleKey(int c) {
     static int quit_times = EDITOR_QUIT_TIMES;
 
+    if (c == CTRL_KEY('a')) { // redraw, in any view and keeping the selection
+        editorScreenReset();
+        return;
+    }
+
+    if (E.statsPanel) { // any key closes the panel
+        E.statsPanel = 0;
+        return;
+    }
+    if (H.active && editorHexKey(c)) return;
+    if (E.selection == SELECT_BLOCK && editorBlockKey(c)) return;
+    if (E.selection == SELECT_CHAR || E.selection == SELECT_LINE) editorSelectKey(c);
+
     switch (c) {        
         case CTRL_KEY('q') :         // exit on CTrl+Q
             if (E.dirty && quit_times > 0) {
@@ -999,7 +5464,10 @@ void editorProcessKey() {
         case PAGE_UP:
         case PAGE_DOWN:
             {
-                if (c == PAGE_UP) {
+                if (E.softWrap) {
+                    long long top = editorWrapTopLine();
+                    editorWrapGotoLine(c == PAGE_UP ? top : top + E.screenrows - 1, 0);
+                } else if (c == PAGE_UP) {
                     E.cursorY = E.rowOff;
                 } else if (c == PAGE_DOWN) {
                     E.cursorY = E.rowOff + E.screenrows - 1;
@@ -1029,22 +5497,71 @@ void editorProcessKey() {
             if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
             editorDelChar();
             break;
-        case CTRL_KEY('l'): // do nothing for escape key and Ctrl+L
-        case '\x1b':
+        case '\x1b': // do nothing for escape key
             break;
         case CTRL_KEY('s'):
             editorSave();
             break;
         case CTRL_KEY('f'):
-            editorFind();
+            editorFind(0);
+            break;
+        case CTRL_KEY('r'):
+            editorFind(1);
+            break;
+        case CTRL_KEY('g'):
+            editorGoto();
+            break;
+        case CTRL_KEY('w'):
+            editorToggleSoftWrap();
+            break;
+        case CTRL_KEY('t'):
+            E.statsPanel = 1;
+            break;
+        case CTRL_KEY('o'):
+            editorOutline();
+            break;
+        case CTRL_KEY('n'):
+            editorComplete();
+            break;
+        case CTRL_KEY('b'):
+            editorBlockSelect();
+            break;
+        case CTRL_KEY('e'):
+            editorSelect(SELECT_CHAR);
+            break;
+        case CTRL_KEY('l'):
+            editorSelect(SELECT_LINE);
+            break;
+        case CTRL_KEY('c'):
+            editorClip(0);
+            break;
+        case CTRL_KEY('x'):
+            editorClip(1);
+            break;
+        case CTRL_KEY('v'):
+            editorPaste();
+            break;
+        case CTRL_KEY('k'):
+            editorMacroToggle();
+            break;
+        case CTRL_KEY('p'):
+            editorMacroPlay();
+            break;
+        case CTRL_KEY('u'):
+            editorFilter();
             break;
         default:
             editorInsertChar(c);
     }
+    if (E.selection == SELECT_BLOCK) editorBlockMoved(c);
 
     quit_times = EDITOR_QUIT_TIMES;
 }
 
+void editorProcessKey() {
+    editorHandleKey(editorReadKey());
+}
+
 char* editorPrompt(char *prompt, void (*callback)(char* query, int cur_key)) {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
@@ -1052,9 +5569,10 @@ char* editorPrompt(char *prompt, void (*callback)(char* query, int cur_key)) {
     size_t buflen = 0;
     buf[0] = '\0';
 
+    E.inPrompt = 1;
+    editorSetStatusMessage(prompt, buf);
     while (1) {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshTerminal();
+        editorRefreshPaced();
 
         int c = editorReadKey();
 
@@ -1062,15 +5580,19 @@ char* editorPrompt(char *prompt, void (*callback)(char* query, int cur_key)) {
             if (buflen != 0) {
                 buf[--buflen] = '\0';
             }
+        } else if (c == CTRL_KEY('a')) {
+            editorScreenReset();
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
-            free(buf);
             if (callback) callback(buf, c);
+            free(buf);
+            E.inPrompt = 0;
             return NULL;
         } else if (c == '\r') {
             if (buflen != 0) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
+                E.inPrompt = 0;
                 return buf;
             }
         } else if (!iscntrl(c) && c < 128) {
@@ -1082,10 +5604,204 @@ char* editorPrompt(char *prompt, void (*callback)(char* query, int cur_key)) {
             buf[buflen] = '\0';
         }
 
+        editorSetStatusMessage(prompt, buf); // the callback may replace it
         if (callback) callback(buf, c);
     }
 }
 
+/*** macros ***/
+
+/* Replaying a macro runs in batch mode: nothing is drawn and highlighting
+is not done row by row as the keys edit the text, which would propagate a
+comment opened on every line through all the rows below it, each time.
+Rows are still rendered as they change; the rows to highlight are merged
+into one range, kept on the same text as rows are inserted or deleted, and
+highlighted in a single pass at the end. */
+
+void editorBatchDefer(int lo, int hi) {
+    if (lo < E.batchLo) E.batchLo = lo;
+    if (hi > E.batchHi) E.batchHi = hi;
+}
+
+// rows from at on moved by delta; when delta < 0, rows [at, at - delta) were deleted
+void editorBatchRowsMoved(int at, int delta) {
+    if (!E.batch) return;
+    if (E.batchLo <= E.batchHi) {
+        int end = delta < 0 ? at - delta : at;
+        E.batchLo = E.batchLo >= end ? E.batchLo + delta : E.batchLo > at ? at : E.batchLo;
+        E.batchHi = E.batchHi >= end ? E.batchHi + delta : E.batchHi >= at ? at - 1 : E.batchHi;
+    }
+    if (delta < 0) editorBatchDefer(at, at); // now follows another row
+}
+
+void editorBatchStart() {
+    E.batch = 1;
+    E.batchLo = INT_MAX;
+    E.batchHi = -1;
+}
+
+void editorBatchEnd() {
+    E.batch = 0;
+    if (E.batchHi >= E.numrows) E.batchHi = E.numrows - 1;
+    if (E.batchLo > E.batchHi) return;
+    editorOpenBefore(E.batchLo); // the row above must know its comment state
+    editorHighlightRows(E.batchLo, E.batchHi - E.batchLo + 1);
+}
+
+void editorMacroToggle() {
+    if (M.recording) {
+        M.recording = 0;
+        M.len--; // the Ctrl-K that stopped it
+        editorSetStatusMessage("Recorded %d keys, Ctrl-P to replay", M.len);
+    } else {
+        M.recording = 1;
+        M.len = 0;
+        editorSetStatusMessage("Recording keys, Ctrl-K to stop");
+    }
+}
+
+/* Plays the macro times times, or with from >= 0 once on each of the
+times rows from there, starting at the beginning of the row. The row a
+replay starts on follows the rows the previous ones inserted or deleted. */
+void editorMacroReplay(int times, int from) {
+    double start = editorNow();
+    editorBatchStart();
+    M.playing = 1;
+    int y = from;
+    for (int i = 0; i < times; i++) {
+        int rows = E.numrows;
+        if (from >= 0) {
+            if (y >= E.numrows) break;
+            E.cursorY = y;
+            E.cursorX = 0;
+        }
+        M.pos = 0;
+        while (M.pos < M.len) {
+            int c = editorReadKey();
+            if (c == CTRL_KEY('q') || c == CTRL_KEY('k') || c == CTRL_KEY('p')) continue;
+            editorHandleKey(c);
+            editorScroll(); // keys like PAGE_DOWN move relative to the viewport
+        }
+        y += 1 + E.numrows - rows;
+    }
+    M.playing = 0;
+    editorBatchEnd();
+    editorSetStatusMessage("Replayed %d keys %d times in %.2f s", M.len, times, editorNow() - start);
+}
+
+void editorMacroPlay() {
+    if (M.recording) {
+        editorSetStatusMessage("Stop recording with Ctrl-K first");
+        return;
+    }
+    if (M.len == 0) {
+        editorSetStatusMessage("No macro, Ctrl-K to record one");
+        return;
+    }
+
+    int y0, x0, y1, x1;
+    if (E.selection == SELECT_LINE && editorSelectionBounds(&y0, &x0, &y1, &x1)) {
+        E.selection = SELECT_NONE;
+        editorMacroReplay(y1 - y0 + 1, y0);
+        return;
+    }
+    E.selection = SELECT_NONE;
+
+    char *count = editorPrompt("Replay count: %s (ESC to cancel)", NULL);
+    if (count == NULL) return;
+    int times = atoi(count);
+    free(count);
+    if (times > 0) editorMacroReplay(times, -1);
+}
+
+/*** benchmarks ***/
+
+// types into an empty buffer and reports allocator calls per keystroke
+void editorBenchTyping() {
+    long long before[MEM_SUBSYSTEMS];
+    int keys = 200000;
+
+    editorCloseBuffer();
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) before[i] = ST.mem[i].allocs;
+
+    double start = editorNow();
+    for (int i = 0; i < keys; i++) {
+        if (i % 64 == 63) {
+            editorInsertNewLine();
+        } else {
+            editorInsertChar('a' + i % 26);
+        }
+    }
+    double elapsed = editorNow() - start;
+
+    printf("typing: %d keys in %.3f s, %.3f us per key\n", keys, elapsed, elapsed * 1e6 / keys);
+    for (int i = 0; i < MEM_SUBSYSTEMS; i++) {
+        long long allocs = ST.mem[i].allocs - before[i];
+        if (allocs) {
+            printf("  %-14s %lld allocs, %.4f per key\n", memSubsystemNames[i], allocs, (double)allocs / keys);
+        }
+    }
+    editorCloseBuffer();
+}
+
+// times the generic and the generated highlighter over the same C buffer
+void editorBenchSyntax() {
+    char *lines[] = {
+        "/* multi line comment opening",
+        "   and closing */ static int counter = 0; // trailing comment",
+        "int main(int argc, char **argv) {",
+        "\tfor (int i = 0; i < argc; i++) {",
+        "\t\tif (argv[i][0] == '-') printf(\"option %s %d\\n\", argv[i], 42);",
+        "\t\telse continue;",
+        "\t}",
+        "\tdouble ratio = 3.14159 * counter; unsigned long mask = 0xff;",
+        "\treturn NULL == argv ? 1 : 0;",
+        "}",
+    };
+    int nlines = sizeof(lines) / sizeof(lines[0]);
+    int rows = 50000, passes = 10;
+
+    editorCloseBuffer();
+    for (int i = 0; i < rows; i++) {
+        editorInsertRow(E.numrows, lines[i % nlines], strlen(lines[i % nlines]));
+    }
+    E.syntax = &HLDB[0];
+
+    unsigned char **expected = malloc(sizeof(unsigned char *) * rows);
+    double elapsed[2];
+    for (int variant = 0; variant < 2; variant++) {
+        int (*highlight)(editorrow *) = variant ? editorGeneratedHighlighters[0] : editorHighlightGeneric;
+        double start = editorNow();
+        for (int pass = 0; pass < passes; pass++) {
+            for (int i = 0; i < E.numrows; i++) highlight(&E.erow[i]);
+        }
+        elapsed[variant] = editorNow() - start;
+
+        for (int i = 0; i < E.numrows; i++) {
+            if (variant == 0) {
+                expected[i] = malloc(E.erow[i].rsize + 1);
+                memcpy(expected[i], E.erow[i].hl, E.erow[i].rsize);
+            } else if (memcmp(expected[i], E.erow[i].hl, E.erow[i].rsize)) {
+                printf("syntax: generated highlighter differs at row %d\n", i);
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < rows; i++) free(expected[i]);
+    free(expected);
+
+    printf("syntax: %d rows x %d passes, generic %.3f s, generated %.3f s, %.2fx faster\n",
+        rows, passes, elapsed[0], elapsed[1], elapsed[1] > 0 ? elapsed[0] / elapsed[1] : 0.0);
+    E.syntax = NULL;
+    editorCloseBuffer();
+}
+
+int editorBench() {
+    editorBenchTyping();
+    editorBenchSyntax();
+    return 0;
+}
+
 /*** init ***/
 
 void initEditor() {
@@ -1093,6 +5809,7 @@ void initEditor() {
     E.cursorY = 0;
     E.numrows = 0;
     E.erow = NULL;
+    E.rowcap = 0;
     E.rowOff = 0;
     E.colOff = 0;
     E.renderX = 0;
@@ -1101,24 +5818,73 @@ void initEditor() {
     E.statusmsg_time = 0;
     E.dirty = 0;
     E.syntax = NULL;
-
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
+    E.highlight = editorHighlightGeneric;
+    E.watchfd = -1;
+    E.watchwd = -1;
+    E.diskChanged = 0;
+    E.inPrompt = 0;
+    E.softWrap = 0;
+    E.wrapOff = 0;
+    E.vlines.stale = 1;
+    E.streamfd = -1;
+    E.followfd = -1;
+    E.streamName = NULL;
+    E.followPending = 0;
+    E.streamLine = NULL;
+    E.streamLineLen = 0;
+    E.streamLineCap = 0;
+    E.streamBytes = 0;
+    E.streamTime = 0;
+    E.statsPanel = 0;
+    E.frameTime = 0;
+    E.frameInterval = 1.0 / FRAME_RATE;
+    E.frameCost = 0;
+    E.framePending = 0;
+    E.selection = SELECT_NONE;
+    E.screenLines = NULL;
+    E.screenTop = 0;
+    ST.fpsStart = editorNow();
+
+    if (!isatty(STDOUT_FILENO)) { // reports only, nothing is drawn
+        E.screenrows = 24;
+        E.screencols = 80;
+    } else if (getWindowSize(&E.screenrows, &E.screencols) == -1) {
         die("getWindowSize");
     }
     E.screenrows -= 2; // for status and message bar
 }
 
 int main(int argc, char *argv[]) {
+    if (argc >= 2 && !strcmp(argv[1], "--bench")) {
+        initEditor();
+        return editorBench();
+    }
+    if (argc >= 3 && !strcmp(argv[1], "--stats")) {
+        initEditor();
+        return editorPrintStats(argv[2]);
+    }
+
+    int streamfd = -1;
+    if (argc >= 2 && !strcmp(argv[1], "-")) {
+        streamfd = editorStdinToTerminal();
+    }
+
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
+    if (streamfd != -1) {
+        editorOpenStream(streamfd);
+    } else if (argc >= 3 && !strcmp(argv[1], "-f")) {
+        editorFollow(argv[2]);
+    } else if (argc >= 3 && !strcmp(argv[1], "--hex")) {
+        if (!editorHexOpen(argv[2])) die("mmap");
+    } else if (argc >= 2) {
         editorOpen(argv[1]);
     }
     
-    editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = search");
+    editorSetStatusMessage("HELP: Ctrl-Q = quit | Ctrl-S = save | Ctrl-F = search | Ctrl-R = regex | Ctrl-G = goto | Ctrl-W = wrap | Ctrl-T = stats | Ctrl-O = outline | Ctrl-N = complete | Ctrl-B = block select | Ctrl-E/Ctrl-L = select chars/lines | Ctrl-X/C/V = cut/copy/paste | Ctrl-K/P = record/replay macro | Ctrl-U = filter | Ctrl-A = redraw | Tab = hex/chars column in hex view");
 
     while (1) {
-        editorRefreshTerminal();
+        editorRefreshPaced();
         editorProcessKey();
     }
     return 0;